@@ -24,6 +24,8 @@
 #include <sys/endian.h>
 #include <sys/errno.h>
 #include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
 #include <sys/rman.h>
 
 #include <net/ethernet.h>
@@ -41,6 +43,13 @@
 
 #define ALX_REV_A(_r) ((_r) == ALX_REV_A0 || (_r) == ALX_REV_A1)
 
+/* MII registers that may be cached in the PHY shadow when read */
+#define ALX_PHY_SHADOW_MII	(\
+	BIT(MII_ADVERTISE) |\
+	BIT(MII_CTRL1000) |\
+	BIT(ALX_MII_IER) |\
+	BIT(ALX_MII_DBG_ADDR))
+
 void	alx_enable_osc(struct alx_hw *hw);
 int	alx_get_perm_macaddr(struct alx_hw *hw, u8 *addr);
 u16	alx_get_phy_config(struct alx_hw *hw);
@@ -161,7 +170,7 @@ void alx_add_mc_addr(struct alx_hw *hw, u8 *addr)
 {
 	u32 crc32, bit, reg;
 
-	crc32 = ether_crc32_le(addr, ETH_ALEN);
+	crc32 = ether_crc32_be(addr, ETH_ALEN);
 
 	/* The HASH Table  is a register array of 2 32-bit registers.
 	 * It is treated like an array of 64 bits.  We want to set
@@ -345,6 +354,7 @@ alx_reset_phy(struct alx_hw *hw, bool hib_en)
 	else
 		val &= ~(ALX_PHY_CTRL_HIB_PULSE | ALX_PHY_CTRL_HIB_EN);
 	ALX_MEM_W32(hw, ALX_PHY_CTRL, val);
+	alx_phy_shadow_invalidate(hw);
 	udelay(10);
 	ALX_MEM_W32(hw, ALX_PHY_CTRL, val | ALX_PHY_CTRL_DSPRST_OUT);
 
@@ -830,6 +840,7 @@ config_reg:
 		ALX_MEM_W32(hw, ALX_MASTER, master);
 		ALX_MEM_W32(hw, ALX_MAC_CTRL, mac);
 		ALX_MEM_W32(hw, ALX_PHY_CTRL, phy);
+		alx_phy_shadow_invalidate(hw);
 
 		/* set val of PDLL D3PLLOFF */
 		ALX_MEM_R32(hw, ALX_PDLL_TRNS1, &val);
@@ -981,36 +992,133 @@ int __alx_write_phy_core(struct alx_hw *hw, bool ext, u8 dev,
 	return err;
 }
 
+/* drop all shadowed PHY registers, e.g. because the PHY was reset */
+void alx_phy_shadow_invalidate(struct alx_hw *hw)
+{
+	spin_lock(&hw->mdio_lock);
+	memset(&hw->phy_shadow, 0, sizeof(hw->phy_shadow));
+	spin_unlock(&hw->mdio_lock);
+}
+
 /* read from PHY normal register */
 int __alx_read_phy_reg(struct alx_hw *hw, u16 reg, u16 *phy_data)
 {
-	return __alx_read_phy_core(hw, false, 0, reg, phy_data);
+	struct alx_phy_shadow *ps = &hw->phy_shadow;
+	int err;
+
+	if (reg < 32 && (ps->mii_valid & BIT(reg))) {
+		*phy_data = ps->mii[reg];
+		return 0;
+	}
+
+	err = __alx_read_phy_core(hw, false, 0, reg, phy_data);
+	if (!err && reg < 32 && (ALX_PHY_SHADOW_MII & BIT(reg))) {
+		ps->mii[reg] = *phy_data;
+		ps->mii_valid |= BIT(reg);
+	}
+
+	return err;
 }
 
 /* write to PHY normal register */
 int __alx_write_phy_reg(struct alx_hw *hw, u16 reg, u16 phy_data)
 {
-	return __alx_write_phy_core(hw, false, 0, reg, phy_data);
+	struct alx_phy_shadow *ps = &hw->phy_shadow;
+	int err;
+
+	err = __alx_write_phy_core(hw, false, 0, reg, phy_data);
+
+	if (reg == MII_BMCR && (phy_data & BMCR_RESET))
+		memset(ps, 0, sizeof(*ps));
+	else if (reg < 32 && (ALX_PHY_SHADOW_MII & BIT(reg))) {
+		/* on failure we don't know what the PHY ended up with */
+		if (err)
+			ps->mii_valid &= ~BIT(reg);
+		else {
+			ps->mii[reg] = phy_data;
+			ps->mii_valid |= BIT(reg);
+		}
+	}
+
+	return err;
+}
+
+static int __alx_phy_shadow_ext(struct alx_hw *hw, u8 dev, u16 reg)
+{
+	struct alx_phy_shadow *ps = &hw->phy_shadow;
+	int i;
+
+	for (i = 0; i < ALX_PHY_SHADOW_EXT; i++)
+		if (ps->ext[i].valid && ps->ext[i].dev == dev &&
+		    ps->ext[i].reg == reg)
+			return i;
+	return -1;
 }
 
 /* read from PHY extension register */
 int __alx_read_phy_ext(struct alx_hw *hw, u8 dev, u16 reg, u16 *pdata)
 {
+	int i;
+
+	i = __alx_phy_shadow_ext(hw, dev, reg);
+	if (i >= 0) {
+		*pdata = hw->phy_shadow.ext[i].val;
+		return 0;
+	}
+
 	return __alx_read_phy_core(hw, true, dev, reg, pdata);
 }
 
 /* write to PHY extension register */
 int __alx_write_phy_ext(struct alx_hw *hw, u8 dev, u16 reg, u16 data)
 {
-	return __alx_write_phy_core(hw, true, dev, reg, data);
+	struct alx_phy_shadow *ps = &hw->phy_shadow;
+	int err, i;
+
+	err = __alx_write_phy_core(hw, true, dev, reg, data);
+
+	i = __alx_phy_shadow_ext(hw, dev, reg);
+	if (err) {
+		if (i >= 0)
+			ps->ext[i].valid = false;
+		return err;
+	}
+	if (i < 0) {
+		i = ps->ext_next;
+		ps->ext_next = (i + 1) % ALX_PHY_SHADOW_EXT;
+	}
+	ps->ext[i].valid = true;
+	ps->ext[i].dev = dev;
+	ps->ext[i].reg = reg;
+	ps->ext[i].val = data;
+
+	return 0;
+}
+
+/* select a PHY debug port register, unless it already is */
+static int __alx_select_phy_dbg(struct alx_hw *hw, u16 reg)
+{
+	struct alx_phy_shadow *ps = &hw->phy_shadow;
+
+	if ((ps->mii_valid & BIT(ALX_MII_DBG_ADDR)) &&
+	    ps->mii[ALX_MII_DBG_ADDR] == reg)
+		return 0;
+
+	return __alx_write_phy_reg(hw, ALX_MII_DBG_ADDR, reg);
 }
 
 /* read from PHY debug port */
 int __alx_read_phy_dbg(struct alx_hw *hw, u16 reg, u16 *pdata)
 {
+	struct alx_phy_shadow *ps = &hw->phy_shadow;
 	int err;
 
-	err = __alx_write_phy_reg(hw, ALX_MII_DBG_ADDR, reg);
+	if (reg < 64 && (ps->dbg_valid & (1ULL << reg))) {
+		*pdata = ps->dbg[reg];
+		return 0;
+	}
+
+	err = __alx_select_phy_dbg(hw, reg);
 	if (unlikely(err))
 		return err;
 	else
@@ -1022,14 +1130,24 @@ int __alx_read_phy_dbg(struct alx_hw *hw, u16 reg, u16 *pdata)
 /* write to PHY debug port */
 int __alx_write_phy_dbg(struct alx_hw *hw, u16 reg, u16 data)
 {
+	struct alx_phy_shadow *ps = &hw->phy_shadow;
 	int err;
 
-	err = __alx_write_phy_reg(hw, ALX_MII_DBG_ADDR, reg);
+	err = __alx_select_phy_dbg(hw, reg);
 	if (unlikely(err))
 		return err;
 	else
 		err = __alx_write_phy_reg(hw, ALX_MII_DBG_DATA, data);
 
+	if (reg < 64) {
+		if (err)
+			ps->dbg_valid &= ~(1ULL << reg);
+		else {
+			ps->dbg[reg] = data;
+			ps->dbg_valid |= 1ULL << reg;
+		}
+	}
+
 	return err;
 }
 
@@ -1139,8 +1257,13 @@ int alx_get_phy_link(struct alx_hw *hw, bool *link_up, u16 *speed)
 	u16 bmsr, giga;
 	int err;
 
+	/*
+	 * The link status bit latches low, so if it reads as up the link
+	 * has been up all along and there is no need to read it again.
+	 */
 	err = alx_read_phy_reg(hw, MII_BMSR, &bmsr);
-	err = alx_read_phy_reg(hw, MII_BMSR, &bmsr);
+	if (!err && !(bmsr & BMSR_LSTATUS))
+		err = alx_read_phy_reg(hw, MII_BMSR, &bmsr);
 	if (unlikely(err))
 		goto out;
 
@@ -1349,14 +1472,20 @@ void alx_configure_basic(struct alx_hw *hw)
 	ALX_MEM_W32(hw, ALX_DMA, val);
 
 	/* multi-tx-q weight */
-	if (ALX_CAP(hw, MTQ)) {
-		val = FIELDX(ALX_WRR_PRI, hw->wrr_ctrl) |
-		      FIELDX(ALX_WRR_PRI0, hw->wrr[0]) |
-		      FIELDX(ALX_WRR_PRI1, hw->wrr[1]) |
-		      FIELDX(ALX_WRR_PRI2, hw->wrr[2]) |
-		      FIELDX(ALX_WRR_PRI3, hw->wrr[3]);
-		ALX_MEM_W32(hw, ALX_WRR, val);
-	}
+	if (ALX_CAP(hw, MTQ))
+		alx_configure_wrr(hw);
+}
+
+void alx_configure_wrr(struct alx_hw *hw)
+{
+	u32 val;
+
+	val = FIELDX(ALX_WRR_PRI, hw->wrr_ctrl) |
+	      FIELDX(ALX_WRR_PRI0, hw->wrr[0]) |
+	      FIELDX(ALX_WRR_PRI1, hw->wrr[1]) |
+	      FIELDX(ALX_WRR_PRI2, hw->wrr[2]) |
+	      FIELDX(ALX_WRR_PRI3, hw->wrr[3]);
+	ALX_MEM_W32(hw, ALX_WRR, val);
 }
 
 void alx_mask_msix(struct alx_hw *hw, int index, bool mask)
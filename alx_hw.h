@@ -414,6 +414,15 @@ struct alx_hw_stats {
 	ALX_RSS_HASH_TYPE_IPV4_TCP |\
 	ALX_RSS_HASH_TYPE_IPV6 |\
 	ALX_RSS_HASH_TYPE_IPV6_TCP)
+#define ALX_RSS_KEY_SIZE	40
+/* the indirection table packs eight 4-bit queue numbers into each word */
+#define ALX_RSS_IDT_MAX		(32 * 8)
+#define ALX_RSS_IDT_GET(hw, i)	\
+	(((hw)->rss_idt[(i) / 8] >> (((i) % 8) * 4)) & 0xF)
+#define ALX_RSS_IDT_SET(hw, i, q) do {				\
+	(hw)->rss_idt[(i) / 8] &= ~(0xFU << (((i) % 8) * 4));	\
+	(hw)->rss_idt[(i) / 8] |= ((q) & 0xFU) << (((i) % 8) * 4);	\
+} while (0)
 #define ALX_DEF_RXBUF_SIZE	1536
 #define ALX_MAX_JUMBO_PKT_SIZE	(9*1024)
 #define ALX_MAX_TSO_PKT_SIZE	(7*1024)
@@ -471,6 +480,31 @@ struct alx_hw_stats {
 (((_v) & (_name##_MASK)) << (_name##_SHIFT)))
 #define FIELDX(_name, _v) (((_v) & (_name##_MASK)) << (_name##_SHIFT))
 
+/*
+ * Shadow copies of PHY registers that only change when the driver writes
+ * them, so reading them back does not cost an MDIO transaction. Debug port
+ * and extension registers are only cached once written, since some of them
+ * report status. Everything is dropped when the PHY is reset.
+ */
+#define ALX_PHY_SHADOW_EXT	8
+
+struct alx_phy_shadow {
+	/* MII registers, one valid bit per register */
+	u32			mii_valid;
+	u16			mii[32];
+	/* debug port registers */
+	u64			dbg_valid;
+	u16			dbg[64];
+	/* extension registers, replaced round-robin */
+	struct {
+		bool		valid;
+		u8		dev;
+		u16		reg;
+		u16		val;
+	}			ext[ALX_PHY_SHADOW_EXT];
+	int			ext_next;
+};
+
 struct alx_hw {
 	device_t         dev;
 	struct resource *hw_addr;
@@ -496,7 +530,7 @@ struct alx_hw {
 	u32			rx_ctrl;
 	u32			mc_hash[2];
 
-	u8			rss_key[40];
+	u8			rss_key[ALX_RSS_KEY_SIZE];
 	u32			rss_idt[32];
 	u16			rss_idt_size;
 	u8			rss_hash_type;
@@ -525,10 +559,11 @@ struct alx_hw {
 	u16			max_ptrns;
 
 #ifdef notyet
-	spinlock_t		mdio_lock;
 	struct mdio_if_info	mdio;
 #endif
-        int                     mdio_lock;
+	/* serializes MDIO transactions and phy_shadow; a leaf lock */
+	struct mtx		mdio_lock;
+	struct alx_phy_shadow	phy_shadow;
 	u16			phy_id[2];
 
 	struct alx_hw_stats	stats;
@@ -602,6 +637,7 @@ enum ALX_CAPS {
 int alx_get_perm_macaddr(struct alx_hw *hw, u8 *addr);
 void alx_add_mc_addr(struct alx_hw *hw, u8 *addr);
 void alx_reset_phy(struct alx_hw *hw, bool hib_en);
+void alx_phy_shadow_invalidate(struct alx_hw *hw);
 void alx_reset_pcie(struct alx_hw *hw);
 void alx_enable_aspm(struct alx_hw *hw, bool l0s_en, bool l1_en);
 int alx_setup_speed_duplex(struct alx_hw *hw, u32 ethadv, u8 flowctrl);
@@ -623,6 +659,7 @@ int alx_reset_mac(struct alx_hw *hw);
 void alx_set_macaddr(struct alx_hw *hw, u8 *addr);
 bool alx_phy_configed(struct alx_hw *hw);
 void alx_configure_basic(struct alx_hw *hw);
+void alx_configure_wrr(struct alx_hw *hw);
 void alx_configure_rss(struct alx_hw *hw, bool en);
 void alx_mask_msix(struct alx_hw *hw, int index, bool mask);
 int alx_select_powersaving_speed(struct alx_hw *hw, u16 *speed);
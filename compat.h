@@ -42,6 +42,7 @@ typedef vm_paddr_t dma_addr_t;
 #define DEFINE_DMA_UNMAP_LEN(name)	u32 name
 
 #define set_bit(bit, name)	bit_set((bitstr_t *)name, bit)
+#define clear_bit(bit, name)	bit_clear((bitstr_t *)name, bit)
 #define test_bit(bit, name)	bit_test((bitstr_t *)name, bit)
 
 #define SPEED_10	10
@@ -92,10 +93,10 @@ typedef vm_paddr_t dma_addr_t;
 #define PCI_MSIX_ENTRY_CTRL_MASKBIT	1
 
 #define unlikely(x)	x
+#define prefetch(x)	__builtin_prefetch(x)
 
-/* XXX */
-#define spin_lock(x)
-#define spin_unlock(x)
+#define spin_lock(x)	mtx_lock(x)
+#define spin_unlock(x)	mtx_unlock(x)
 
 #define ARRAY_SIZE(x)   (sizeof(x) / sizeof(x[0]))
 
@@ -17,18 +17,25 @@
 
 #include <sys/cdefs.h>
 
+#include "opt_rss.h"
+
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/bitstring.h>
+#include <sys/buf_ring.h>
 #include <sys/bus.h>
+#include <sys/callout.h>
+#include <sys/cpuset.h>
 #include <sys/endian.h>
 #include <sys/kernel.h>
 #include <sys/lock.h>
+#include <sys/malloc.h>
 #include <sys/mbuf.h>
 #include <sys/module.h>
 #include <sys/mutex.h>
 #include <sys/queue.h>
 #include <sys/rman.h>
+#include <sys/smp.h>
 #include <sys/socket.h>
 #include <sys/sockio.h>
 #include <sys/sysctl.h>
@@ -42,8 +49,15 @@
 #include <net/if_types.h>
 #include <net/if_var.h>
 #include <net/if_vlan_var.h>
+#include <net/pfil.h>
+#ifdef RSS
+#include <net/rss_config.h>
+#endif
 
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp_lro.h>
 
 #include <dev/pci/pcireg.h>
 #include <dev/pci/pcivar.h>
@@ -57,6 +71,28 @@
 
 MODULE_DEPEND(alx, pci, 1, 1, 1);
 MODULE_DEPEND(alx, ether, 1, 1, 1);
+#ifdef DEV_NETMAP
+MODULE_DEPEND(alx, netmap, 1, 1, 1);
+#endif
+
+/*
+ * Layout checks for the structures shared between the transmit and receive
+ * paths. Run "make pahole" for the full picture.
+ */
+#define	ALX_LINE(t, f)	(offsetof(struct t, f) / CACHE_LINE_SIZE)
+CTASSERT(sizeof(struct alx_tx_queue) % CACHE_LINE_SIZE == 0);
+CTASSERT(sizeof(struct alx_rx_queue) % CACHE_LINE_SIZE == 0);
+CTASSERT(ALX_LINE(alx_tx_queue, pidx) != ALX_LINE(alx_tx_queue, cidx));
+CTASSERT(ALX_LINE(alx_tx_queue, pidx) != ALX_LINE(alx_tx_queue, bf_info));
+CTASSERT(ALX_LINE(alx_tx_queue, watchdog_timer) ==
+    ALX_LINE(alx_tx_queue, cidx));
+CTASSERT(ALX_LINE(alx_rx_queue, pidx) != ALX_LINE(alx_rx_queue, cidx));
+CTASSERT(ALX_LINE(alx_rx_queue, pidx) != ALX_LINE(alx_rx_queue, bf_info));
+CTASSERT(offsetof(struct alx_softc, alx_mtx) % CACHE_LINE_SIZE == 0);
+CTASSERT(offsetof(struct alx_softc, alx_txq) % CACHE_LINE_SIZE == 0);
+CTASSERT(offsetof(struct alx_softc, alx_rx_queue) % CACHE_LINE_SIZE == 0);
+CTASSERT(ALX_LINE(alx_softc, alx_media) < ALX_LINE(alx_softc, alx_mtx));
+#undef ALX_LINE
 
 static struct alx_dev {
 	uint16_t	 alx_vendorid;
@@ -73,6 +109,34 @@ static struct alx_dev {
 	    "Qualcomm Atheros AR8172 Fast Ethernet" },
 };
 
+/*
+ * WRR_PRI settings, by the number of highest-priority TX rings that are
+ * served strictly before the rest share the link by weight.
+ */
+static const int alx_wrr_strict[] = {
+	ALX_WRR_PRI_RESTRICT_NONE,
+	ALX_WRR_PRI_RESTRICT_HI,
+	ALX_WRR_PRI_RESTRICT_HI2,
+	ALX_WRR_PRI_RESTRICT_ALL,
+};
+
+/* Per-queue TPD registers and interrupt status bits, by TX queue index. */
+static const struct alx_txq_reg {
+	uint32_t	 addr_lo;
+	uint32_t	 pidx;
+	uint32_t	 cidx;
+	uint32_t	 intr;
+} alx_txq_regs[ALX_MAX_TX_QUEUES] = {
+	{ ALX_TPD_PRI0_ADDR_LO, ALX_TPD_PRI0_PIDX, ALX_TPD_PRI0_CIDX,
+	    ALX_ISR_TX_Q0 },
+	{ ALX_TPD_PRI1_ADDR_LO, ALX_TPD_PRI1_PIDX, ALX_TPD_PRI1_CIDX,
+	    ALX_ISR_TX_Q1 },
+	{ ALX_TPD_PRI2_ADDR_LO, ALX_TPD_PRI2_PIDX, ALX_TPD_PRI2_CIDX,
+	    ALX_ISR_TX_Q2 },
+	{ ALX_TPD_PRI3_ADDR_LO, ALX_TPD_PRI3_PIDX, ALX_TPD_PRI3_CIDX,
+	    ALX_ISR_TX_Q3 },
+};
+
 static int	alx_attach(device_t);
 static int	alx_detach(device_t);
 static int	alx_probe(device_t);
@@ -84,33 +148,81 @@ static int	alx_suspend(device_t);
 static int	alx_ioctl(struct ifnet *, u_long, caddr_t);
 static void	alx_init(void *);
 static void	alx_init_locked(struct alx_softc *);
+static bool	alx_rings_rewound(struct alx_softc *);
 static int	alx_media_change(struct ifnet *);
 static void	alx_media_status(struct ifnet *, struct ifmediareq *);
-static void	alx_start(struct ifnet *);
-static void	alx_start_locked(struct ifnet *);
+static int	alx_transmit(struct ifnet *, struct mbuf *);
+static void	alx_qflush(struct ifnet *);
+static void	alx_txq_drain(struct alx_softc *, struct alx_tx_queue *);
+static void	alx_txq_task(void *, int);
 
 static int	alx_alloc_intr(struct alx_softc *);
+static int	alx_intr_cpu(struct alx_softc *);
 static void	alx_free_intr(struct alx_softc *);
 static void	alx_link_task(void *, int);
+static void	alx_reset_task(void *, int);
+static void	alx_tick(void *);
 static void	alx_int_task(void *, int);
 static void	alx_intr_disable(struct alx_softc *);
 static void	alx_intr_enable(struct alx_softc *);
+static int	alx_intr_filter(struct alx_softc *, uint32_t);
 static int	alx_intr_legacy(void *);
 static int	alx_intr_msi(void *);
+static void	alx_intr_thread(void *);
+static bool	alx_intr_process(struct alx_softc *);
 
 static void	alx_reset(struct alx_softc *sc);
+static void	alx_reconfigure(struct alx_softc *);
+static void	alx_rss_init(struct alx_softc *);
+static u_int	alx_hash_maddr(void *, struct sockaddr_dl *, u_int);
+static void	alx_rxfilter(struct alx_softc *);
+static void	alx_phy_down(struct alx_softc *);
 static void	alx_update_link(struct alx_softc *);
+static void	alx_set_link(struct alx_softc *, bool, uint16_t);
 
 static int	alx_dma_alloc(struct alx_softc *);
+static int	alx_dma_alloc_rings(struct alx_softc *, int);
+static bus_size_t alx_ring_layout(struct alx_softc *);
 static void	alx_dma_free(struct alx_softc *);
+static void	alx_dma_free_rings(struct alx_softc *);
+static int	alx_resize_rings(struct alx_softc *, int, int);
+static int	alx_sysctl_ring_size(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_process_limit(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_rss_key(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_rss_indir(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_rss_hash_types(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_bql_limit(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_tx_copy_thresh(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_prio_map(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_wrr(SYSCTL_HANDLER_ARGS);
+static int	alx_sysctl_wrr_strict(SYSCTL_HANDLER_ARGS);
+static void	alx_sysctl_attach(struct alx_softc *);
 static void	alx_dmamap_cb(void *, bus_dma_segment_t *, int, int);
 
 static void	alx_init_rx_ring(struct alx_softc *);
+static void	alx_size_rx_queues(struct alx_softc *);
 static void	alx_init_tx_ring(struct alx_softc *);
 static int	alx_newbuf(struct alx_softc *, int);
-static void	alx_rxintr(struct alx_softc *);
-static void	alx_txintr(struct alx_softc *);
-static int	alx_xmit(struct alx_softc *, struct mbuf **);
+static bool	alx_rxintr(struct alx_softc *, int);
+static void	alx_rx_reset(struct alx_softc *);
+static int	alx_rx_hashtype(uint32_t);
+static void	alx_rx_csum(struct mbuf *, struct rrd_desc *);
+static void	alx_srss_alloc(struct alx_softc *);
+static void	alx_srss_free(struct alx_softc *);
+static void	alx_srss_enqueue(struct alx_softc *, struct mbuf *);
+static void	alx_srss_task(void *, int);
+static int	alx_tx_classify(struct alx_softc *, struct mbuf *);
+static void	alx_txintr(struct alx_softc *, struct alx_tx_queue *);
+static void	alx_bql_completed(struct alx_softc *, struct alx_tx_queue *,
+		    u_int);
+static int	alx_xmit(struct alx_softc *, struct alx_tx_queue *,
+		    struct mbuf **);
+static int	alx_xmit_copy(struct alx_softc *, struct alx_tx_queue *,
+		    struct mbuf **);
+
+#ifdef DEV_NETMAP
+#include "if_alx_netmap.h"
+#endif
 
 static device_method_t alx_methods[] = {
 	DEVMETHOD(device_probe,		alx_probe),
@@ -145,6 +257,57 @@ TUNABLE_INT("hw.alx.enable_msi", &alx_enable_msi);
 SYSCTL_INT(_hw_alx, OID_AUTO, enable_msi, CTLFLAG_RDTUN, &alx_enable_msi,
     0, "Enable MSI interrupts");
 
+static int alx_intr_ithread = 0;
+TUNABLE_INT("hw.alx.intr_ithread", &alx_intr_ithread);
+SYSCTL_INT(_hw_alx, OID_AUTO, intr_ithread, CTLFLAG_RDTUN, &alx_intr_ithread,
+    0, "Process rings in the interrupt thread instead of a taskqueue");
+
+static int alx_process_limit = ALX_DEFAULT_RX_WORK;
+TUNABLE_INT("hw.alx.process_limit", &alx_process_limit);
+SYSCTL_INT(_hw_alx, OID_AUTO, process_limit, CTLFLAG_RDTUN,
+    &alx_process_limit, 0, "Default number of frames received per pass");
+
+static int alx_keep_link = 1;
+TUNABLE_INT("hw.alx.keep_link", &alx_keep_link);
+SYSCTL_INT(_hw_alx, OID_AUTO, keep_link, CTLFLAG_RDTUN, &alx_keep_link,
+    0, "Keep the PHY link up while the interface is down");
+
+static int alx_soft_rss = 0;
+TUNABLE_INT("hw.alx.soft_rss", &alx_soft_rss);
+SYSCTL_INT(_hw_alx, OID_AUTO, soft_rss, CTLFLAG_RDTUN, &alx_soft_rss,
+    0, "Spread received frames over per-CPU queues in software");
+
+static int alx_mc_hash_max = 32;
+TUNABLE_INT("hw.alx.mc_hash_max", &alx_mc_hash_max);
+SYSCTL_INT(_hw_alx, OID_AUTO, mc_hash_max, CTLFLAG_RWTUN, &alx_mc_hash_max,
+    0, "Multicast groups filtered by hash before accepting all multicast");
+
+static int alx_tx_prio = 1;
+TUNABLE_INT("hw.alx.tx_prio", &alx_tx_prio);
+SYSCTL_INT(_hw_alx, OID_AUTO, tx_prio, CTLFLAG_RDTUN, &alx_tx_prio, 0,
+    "Use the four TX priority rings, selected by VLAN PCP or DSCP");
+
+static int alx_tx_bql_max = ALX_BQL_MAX_DEF;
+TUNABLE_INT("hw.alx.tx_bql_max", &alx_tx_bql_max);
+SYSCTL_INT(_hw_alx, OID_AUTO, tx_bql_max, CTLFLAG_RDTUN, &alx_tx_bql_max,
+    0, "Upper bound for the TX byte queue limit (0 to disable)");
+
+static int alx_tx_copy_thresh = ALX_TX_COPY_SZ;
+TUNABLE_INT("hw.alx.tx_copy_thresh", &alx_tx_copy_thresh);
+SYSCTL_INT(_hw_alx, OID_AUTO, tx_copy_thresh, CTLFLAG_RDTUN,
+    &alx_tx_copy_thresh, 0,
+    "Largest frame copied into a pre-mapped TX buffer instead of mapped");
+
+static int alx_tx_ring_size = ALX_DEF_TX_RING_SZ;
+TUNABLE_INT("hw.alx.tx_ring_size", &alx_tx_ring_size);
+SYSCTL_INT(_hw_alx, OID_AUTO, tx_ring_size, CTLFLAG_RDTUN, &alx_tx_ring_size,
+    0, "Default number of TX descriptors");
+
+static int alx_rx_ring_size = ALX_DEF_RX_RING_SZ;
+TUNABLE_INT("hw.alx.rx_ring_size", &alx_rx_ring_size);
+SYSCTL_INT(_hw_alx, OID_AUTO, rx_ring_size, CTLFLAG_RDTUN, &alx_rx_ring_size,
+    0, "Default number of RX descriptors");
+
 static void
 alx_dmamap_cb(void *arg, bus_dma_segment_t *segs, int nseg, int error)
 {
@@ -155,20 +318,16 @@ alx_dmamap_cb(void *arg, bus_dma_segment_t *segs, int nseg, int error)
 }
 
 /*
- * XXX:
- * - multiple queues
- * - does the chipset's DMA engine support more than one segment?
+ * Create the DMA tags that don't depend on the ring sizes, then allocate the
+ * rings themselves. On failure the caller is expected to call alx_dma_free().
  */
 static int
 alx_dma_alloc(struct alx_softc *sc)
 {
 	device_t dev;
-	struct alx_hw *hw;
-	struct alx_buffer *buf;
-	int error, i;
+	int error;
 
 	dev = sc->alx_dev;
-	hw = &sc->hw;
 
 	/* Create parent tag. */
 	error = bus_dma_tag_create(
@@ -188,198 +347,231 @@ alx_dma_alloc(struct alx_softc *sc)
 		return (error);
 	}
 
-	/* Create the DMA tag for the transmit packet descriptor ring. */
-	/* XXX assuming 1 queue at the moment. */
+	/* Create the DMA tag for the transmit buffers. */
+	/* XXX where do maxsize, nsegments, maxsegsize come from? */
 	error = bus_dma_tag_create(
 	    sc->alx_parent_tag,			/* parent */
 	    8, 0,				/* alignment, boundary */
 	    BUS_SPACE_MAXADDR,			/* lowaddr */
 	    BUS_SPACE_MAXADDR,			/* highaddr */
 	    NULL, NULL,				/* filter, filterarg */
-	    sc->tx_ringsz * sizeof(struct tpd_desc), /* maxsize */
-	    1,					/* nsegments */
-	    sc->tx_ringsz * sizeof(struct tpd_desc), /* maxsegsize */
+	    PAGE_SIZE,				/* maxsize XXX */
+	    32,					/* nsegments XXX */
+	    PAGE_SIZE,				/* maxsegsize */
 	    0,					/* flags */
-	    NULL, NULL,				/* lockfunc, lockfuncarg */
-	    &sc->alx_tx_tag);
-	if (error != 0) {
-		device_printf(dev, "could not create TX descriptor ring tag\n");
-		return (error);
-	}
-
-	/* Allocate DMA memory for the transmit packet descriptor ring. */
-	error = bus_dmamem_alloc(sc->alx_tx_tag,
-	    (void **)&sc->alx_tx_queue.tpd_hdr,
-	    BUS_DMA_WAITOK | BUS_DMA_ZERO | BUS_DMA_COHERENT,
-	    &sc->alx_tx_dmamap);
-	if (error != 0) {
-		device_printf(dev,
-		    "could not allocate DMA'able memory for TX ring\n");
-		/* XXX cleanup */
-		return (error);
-	}
-
-	/* Do the actual DMA mapping of the transmit packet descriptor ring. */
-	error = bus_dmamap_load(sc->alx_tx_tag, sc->alx_tx_dmamap,
-	    sc->alx_tx_queue.tpd_hdr, sc->tx_ringsz * sizeof(struct tpd_desc),
-	    alx_dmamap_cb, &sc->alx_tx_queue.tpd_dma, 0);
+	    NULL, NULL,				/* lockfunc, lockarg */
+	    &sc->alx_tx_buf_tag);
 	if (error != 0) {
-		device_printf(dev, "could not load DMA map for TX ring\n");
-		/* XXX cleanup */
+		device_printf(dev, "could not create TX buffer DMA tag\n");
 		return (error);
 	}
 
-	/* Create the DMA tag for the receive ready descriptor ring. */
-	/* XXX assuming 1 queue at the moment. */
+	/* Create the DMA tag for the receive buffers. */
 	error = bus_dma_tag_create(
 	    sc->alx_parent_tag,			/* parent */
 	    8, 0,				/* alignment, boundary */
 	    BUS_SPACE_MAXADDR,			/* lowaddr */
 	    BUS_SPACE_MAXADDR,			/* highaddr */
 	    NULL, NULL,				/* filter, filterarg */
-	    sc->rx_ringsz * sizeof(struct rrd_desc), /* maxsize */
+	    MCLBYTES,				/* maxsize */
 	    1,					/* nsegments */
-	    sc->rx_ringsz * sizeof(struct rrd_desc), /* maxsegsize */
+	    MCLBYTES,				/* maxsegsize */
 	    0,					/* flags */
-	    NULL, NULL,				/* lockfunc, lockfuncarg */
-	    &sc->alx_rr_tag);
+	    NULL, NULL,				/* lockfunc, lockarg */
+	    &sc->alx_rx_buf_tag);
 	if (error != 0) {
-		device_printf(dev, "could not create RX descriptor ring tag\n");
+		device_printf(dev, "could not create RX buffer DMA tag\n");
 		return (error);
 	}
 
-	error = bus_dmamem_alloc(sc->alx_rr_tag,
-	    (void **)&sc->alx_rx_queue.rrd_hdr,
-	    BUS_DMA_WAITOK | BUS_DMA_ZERO | BUS_DMA_COHERENT,
-	    &sc->alx_rr_dmamap);
-	if (error != 0) {
-		device_printf(dev,
-		    "could not allocate DMA'able memory for RX ring\n");
-		/* XXX cleanup */
-		return (error);
+	return (alx_dma_alloc_rings(sc, BUS_DMA_WAITOK));
+}
+
+/*
+ * Carve the descriptor rings out of the ring header block: the TPD ring of
+ * each TX queue, followed by the RRD and RFD rings. Returns the size of the
+ * block. The ring pointers are only assigned once the block has been
+ * allocated and loaded.
+ */
+static bus_size_t
+alx_ring_layout(struct alx_softc *sc)
+{
+	struct alx_ring_header *rh;
+	struct alx_tx_queue *txq;
+	struct alx_rx_queue *rxq;
+	bus_size_t off;
+	int i;
+
+	rh = &sc->ring_header;
+	off = 0;
+
+	for (i = 0; i < sc->nr_txq; i++) {
+		txq = &sc->alx_txq[i];
+		if (rh->busaddr != 0) {
+			txq->tpd_hdr = (struct tpd_desc *)
+			    ((char *)rh->desc + off);
+			txq->tpd_dma = rh->busaddr + off;
+		}
+		off += roundup2(sc->tx_ringsz * sizeof(struct tpd_desc),
+		    ALX_RING_ALIGN);
 	}
 
-	error = bus_dmamap_load(sc->alx_rr_tag, sc->alx_rr_dmamap,
-	    sc->alx_rx_queue.rrd_hdr, sc->rx_ringsz * sizeof(struct rrd_desc),
-	    alx_dmamap_cb, &sc->alx_rx_queue.rrd_dma, 0);
-	if (error != 0) {
-		device_printf(dev,
-		    "could not load DMA map for RX ready ring\n");
-		/* XXX cleanup */
-		return (error);
+	rxq = &sc->alx_rx_queue;
+	if (rh->busaddr != 0) {
+		rxq->rrd_hdr = (struct rrd_desc *)((char *)rh->desc + off);
+		rxq->rrd_dma = rh->busaddr + off;
+	}
+	off += roundup2(sc->rx_ringsz * sizeof(struct rrd_desc),
+	    ALX_RING_ALIGN);
+
+	if (rh->busaddr != 0) {
+		rxq->rfd_hdr = (struct rfd_desc *)((char *)rh->desc + off);
+		rxq->rfd_dma = rh->busaddr + off;
 	}
+	off += roundup2(sc->rx_ringsz * sizeof(struct rfd_desc),
+	    ALX_RING_ALIGN);
+
+	return (off);
+}
+
+/*
+ * Allocate the descriptor rings and the per-descriptor buffer state, sized
+ * according to sc->tx_ringsz and sc->rx_ringsz. On failure, whatever was
+ * allocated is released again.
+ *
+ * The chip has a single high address register for all TX rings and another
+ * for the RX rings, so every ring is allocated from one coherent block that
+ * may not cross a 4GB boundary.
+ */
+static int
+alx_dma_alloc_rings(struct alx_softc *sc, int how)
+{
+	device_t dev;
+	struct alx_ring_header *rh;
+	struct alx_tx_queue *txq;
+	struct alx_buffer *buf;
+	int error, i, j, mflags;
+
+	dev = sc->alx_dev;
+	rh = &sc->ring_header;
+	mflags = (how & BUS_DMA_NOWAIT) != 0 ? M_NOWAIT : M_WAITOK;
+
+	rh->size = alx_ring_layout(sc);
 
-	/* Create the DMA tag for the receive free descriptor ring. */
-	/* XXX assuming 1 queue at the moment. */
+	/* Create the DMA tag for the descriptor rings. */
 	error = bus_dma_tag_create(
 	    sc->alx_parent_tag,			/* parent */
-	    8, 0,				/* alignment, boundary */
+	    ALX_RING_ALIGN, ALX_RING_BOUNDARY,	/* alignment, boundary */
 	    BUS_SPACE_MAXADDR,			/* lowaddr */
 	    BUS_SPACE_MAXADDR,			/* highaddr */
 	    NULL, NULL,				/* filter, filterarg */
-	    sc->rx_ringsz * sizeof(struct rfd_desc), /* maxsize */
+	    rh->size,				/* maxsize */
 	    1,					/* nsegments */
-	    sc->rx_ringsz * sizeof(struct rfd_desc), /* maxsegsize */
+	    rh->size,				/* maxsegsize */
 	    0,					/* flags */
 	    NULL, NULL,				/* lockfunc, lockfuncarg */
-	    &sc->alx_rx_tag);
+	    &rh->tag);
 	if (error != 0) {
-		device_printf(dev,
-		    "could not create RX descriptor ring DMA tag\n");
-		/* XXX cleanup */
-		return (error);
+		device_printf(dev, "could not create descriptor ring tag\n");
+		goto fail;
 	}
 
-	error = bus_dmamem_alloc(sc->alx_rx_tag,
-	    (void **)&sc->alx_rx_queue.rfd_hdr,
-	    BUS_DMA_WAITOK | BUS_DMA_ZERO | BUS_DMA_COHERENT,
-	    &sc->alx_rx_dmamap);
+	/* Allocate DMA memory for the descriptor rings. */
+	error = bus_dmamem_alloc(rh->tag, &rh->desc,
+	    how | BUS_DMA_ZERO | BUS_DMA_COHERENT, &rh->dma);
 	if (error != 0) {
 		device_printf(dev,
-		    "could not allocate DMA'able memory for RX ring\n");
-		/* XXX cleanup */
-		return (error);
+		    "could not allocate DMA'able memory for descriptor rings\n");
+		goto fail;
 	}
 
-	error = bus_dmamap_load(sc->alx_rx_tag, sc->alx_rx_dmamap,
-	    sc->alx_rx_queue.rfd_hdr, sc->rx_ringsz * sizeof(struct rfd_desc),
-	    alx_dmamap_cb, &sc->alx_rx_queue.rfd_dma, 0);
-	if (error != 0) {
-		device_printf(dev, "could not load DMA map for RX free ring\n");
-		/* XXX cleanup */
-		return (error);
+	/* Do the actual DMA mapping of the descriptor rings. */
+	error = bus_dmamap_load(rh->tag, rh->dma, rh->desc, rh->size,
+	    alx_dmamap_cb, &rh->busaddr, BUS_DMA_NOWAIT);
+	if (error != 0 || rh->busaddr == 0) {
+		device_printf(dev, "could not load DMA map for descriptor rings\n");
+		if (error == 0)
+			error = ENOMEM;
+		goto fail;
 	}
+	KASSERT((rh->busaddr >> 32) == ((rh->busaddr + rh->size - 1) >> 32),
+	    ("descriptor rings cross a 4GB boundary"));
 
-	/* Create the DMA tag for the transmit buffers. */
-	/* XXX where do maxsize, nsegments, maxsegsize come from? */
+	(void)alx_ring_layout(sc);
+
+	/* Create the DMA tag for the TX copy buffers of each queue. */
 	error = bus_dma_tag_create(
 	    sc->alx_parent_tag,			/* parent */
-	    8, 0,				/* alignment, boundary */
+	    ALX_TX_COPY_SZ, 0,			/* alignment, boundary */
 	    BUS_SPACE_MAXADDR,			/* lowaddr */
 	    BUS_SPACE_MAXADDR,			/* highaddr */
 	    NULL, NULL,				/* filter, filterarg */
-	    PAGE_SIZE,				/* maxsize XXX */
-	    32,					/* nsegments XXX */
-	    PAGE_SIZE,				/* maxsegsize */
+	    sc->tx_ringsz * ALX_TX_COPY_SZ,	/* maxsize */
+	    1,					/* nsegments */
+	    sc->tx_ringsz * ALX_TX_COPY_SZ,	/* maxsegsize */
 	    0,					/* flags */
-	    NULL, NULL,				/* lockfunc, lockarg */
-	    &sc->alx_tx_buf_tag);
+	    NULL, NULL,				/* lockfunc, lockfuncarg */
+	    &sc->alx_tx_copy_tag);
 	if (error != 0) {
-		device_printf(dev, "could not create TX buffer DMA tag\n");
-		/* XXX cleanup */
-		return (error);
+		device_printf(dev, "could not create TX copy buffer tag\n");
+		goto fail;
 	}
 
-	/* Allocate space for the TX buffer ring. */
-	sc->alx_tx_queue.bf_info = malloc(
-	    sc->tx_ringsz * sizeof(struct alx_buffer), M_DEVBUF,
-	    M_NOWAIT | M_ZERO);
-	if (sc->alx_tx_queue.bf_info == NULL) {
-		device_printf(dev,
-		    "could not allocate memory for TX buffer ring\n");
-		/* XXX cleanup */
-		return (error);
-	}
+	for (i = 0; i < sc->nr_txq; i++) {
+		txq = &sc->alx_txq[i];
 
-	/* Create DMA maps for the TX buffers. */
-	buf = sc->alx_tx_queue.bf_info;
-	for (i = 0; i < sc->tx_ringsz; i++, buf++) {
-		error = bus_dmamap_create(sc->alx_tx_buf_tag, 0, &buf->dmamap);
-		if (error != 0) {
-			device_printf(dev, "could not create TX DMA map\n");
-			/* XXX cleanup */
-			return (error);
+		/* Allocate space for the TX buffer ring. */
+		txq->bf_info = malloc(sc->tx_ringsz * sizeof(struct alx_buffer),
+		    M_DEVBUF, mflags | M_ZERO);
+		if (txq->bf_info == NULL) {
+			device_printf(dev,
+			    "could not allocate memory for TX buffer ring\n");
+			error = ENOMEM;
+			goto fail;
 		}
-	}
 
-	/* Create the DMA tag for the receive buffers. */
-	error = bus_dma_tag_create(
-	    sc->alx_parent_tag,			/* parent */
-	    8, 0,				/* alignment, boundary */
-	    BUS_SPACE_MAXADDR,			/* lowaddr */
-	    BUS_SPACE_MAXADDR,			/* highaddr */
-	    NULL, NULL,				/* filter, filterarg */
-	    MCLBYTES,				/* maxsize */
-	    1,					/* nsegments */
-	    MCLBYTES,				/* maxsegsize */
-	    0,					/* flags */
-	    NULL, NULL,				/* lockfunc, lockarg */
-	    &sc->alx_rx_buf_tag);
-	if (error != 0) {
-		device_printf(dev, "could not create RX buffer DMA tag\n");
-		/* XXX cleanup */
-		return (error);
+		/* Create DMA maps for the TX buffers. */
+		buf = txq->bf_info;
+		for (j = 0; j < sc->tx_ringsz; j++, buf++) {
+			error = bus_dmamap_create(sc->alx_tx_buf_tag, 0,
+			    &buf->dmamap);
+			if (error != 0) {
+				device_printf(dev,
+				    "could not create TX DMA map\n");
+				goto fail;
+			}
+		}
+
+		/* Allocate and map the copy buffers for small frames. */
+		error = bus_dmamem_alloc(sc->alx_tx_copy_tag,
+		    (void **)&txq->copy_buf, how | BUS_DMA_COHERENT,
+		    &txq->copy_map);
+		if (error != 0) {
+			device_printf(dev,
+			    "could not allocate TX copy buffers\n");
+			goto fail;
+		}
+		error = bus_dmamap_load(sc->alx_tx_copy_tag, txq->copy_map,
+		    txq->copy_buf, sc->tx_ringsz * ALX_TX_COPY_SZ,
+		    alx_dmamap_cb, &txq->copy_dma, BUS_DMA_NOWAIT);
+		if (error != 0 || txq->copy_dma == 0) {
+			device_printf(dev,
+			    "could not load DMA map for TX copy buffers\n");
+			if (error == 0)
+				error = ENOMEM;
+			goto fail;
+		}
 	}
 
 	/* Allocate space for the RX buffer ring. */
 	sc->alx_rx_queue.bf_info = malloc(
 	    sc->rx_ringsz * sizeof(struct alx_buffer), M_DEVBUF,
-	    M_NOWAIT | M_ZERO);
+	    mflags | M_ZERO);
 	if (sc->alx_rx_queue.bf_info == NULL) {
 		device_printf(dev,
 		    "could not allocate memory for RX buffer ring\n");
-		/* XXX cleanup */
-		return (error);
+		error = ENOMEM;
+		goto fail;
 	}
 
 	/* Create DMA maps for the RX buffers. */
@@ -388,121 +580,655 @@ alx_dma_alloc(struct alx_softc *sc)
 		error = bus_dmamap_create(sc->alx_rx_buf_tag, 0, &buf->dmamap);
 		if (error != 0) {
 			device_printf(dev, "could not create RX DMA map\n");
-			/* XXX cleanup */
-			return (error);
+			goto fail;
 		}
 	}
 
+	return (0);
+
+fail:
+	alx_dma_free_rings(sc);
 	return (error);
 }
 
-static void __unused
-alx_dma_free(struct alx_softc *sc)
+/*
+ * Release everything allocated by alx_dma_alloc_rings(). This copes with a
+ * partially completed allocation. Any mbufs must already have been freed by
+ * alx_stop().
+ */
+static void
+alx_dma_free_rings(struct alx_softc *sc)
 {
+	struct alx_ring_header *rh;
+	struct alx_tx_queue *txq;
+	struct alx_buffer *buf;
+	int i, j;
+
+	for (i = 0; i < ALX_MAX_TX_QUEUES; i++) {
+		txq = &sc->alx_txq[i];
+		if (txq->bf_info != NULL) {
+			buf = txq->bf_info;
+			for (j = 0; j < sc->tx_ringsz; j++, buf++)
+				if (buf->dmamap != NULL)
+					bus_dmamap_destroy(sc->alx_tx_buf_tag,
+					    buf->dmamap);
+			free(txq->bf_info, M_DEVBUF);
+			txq->bf_info = NULL;
+		}
+		if (txq->copy_dma != 0) {
+			bus_dmamap_unload(sc->alx_tx_copy_tag, txq->copy_map);
+			txq->copy_dma = 0;
+		}
+		if (txq->copy_buf != NULL) {
+			bus_dmamem_free(sc->alx_tx_copy_tag, txq->copy_buf,
+			    txq->copy_map);
+			txq->copy_buf = NULL;
+		}
+		txq->tpd_hdr = NULL;
+		txq->tpd_dma = 0;
+	}
+	if (sc->alx_tx_copy_tag != NULL) {
+		bus_dma_tag_destroy(sc->alx_tx_copy_tag);
+		sc->alx_tx_copy_tag = NULL;
+	}
 
+	if (sc->alx_rx_queue.bf_info != NULL) {
+		buf = sc->alx_rx_queue.bf_info;
+		for (i = 0; i < sc->rx_ringsz; i++, buf++)
+			if (buf->dmamap != NULL)
+				bus_dmamap_destroy(sc->alx_rx_buf_tag,
+				    buf->dmamap);
+		free(sc->alx_rx_queue.bf_info, M_DEVBUF);
+		sc->alx_rx_queue.bf_info = NULL;
+	}
+	sc->alx_rx_queue.rrd_hdr = NULL;
+	sc->alx_rx_queue.rrd_dma = 0;
+	sc->alx_rx_queue.rfd_hdr = NULL;
+	sc->alx_rx_queue.rfd_dma = 0;
+
+	rh = &sc->ring_header;
+	if (rh->tag != NULL) {
+		if (rh->busaddr != 0)
+			bus_dmamap_unload(rh->tag, rh->dma);
+		if (rh->desc != NULL)
+			bus_dmamem_free(rh->tag, rh->desc, rh->dma);
+		bus_dma_tag_destroy(rh->tag);
+		rh->tag = NULL;
+	}
+	rh->desc = NULL;
+	rh->busaddr = 0;
+	rh->size = 0;
 }
 
+/*
+ * Release all DMA resources. This is safe to call on a partially allocated
+ * softc and more than once.
+ */
 static void
-alx_intr_enable(struct alx_softc *sc)
+alx_dma_free(struct alx_softc *sc)
 {
-	struct alx_hw *hw;
-
-	hw = &sc->hw;
 
-	/* level-1 interrupt switch */
-	ALX_MEM_W32(hw, ALX_ISR, 0);
-	ALX_MEM_W32(hw, ALX_IMR, hw->imask);
-	ALX_MEM_FLUSH(hw);
+	alx_dma_free_rings(sc);
 
-#ifdef __notyet
-	int i;
-	/* enable all individual MSIX IRQs */
-	if (ALX_FLAG(sc, USING_MSIX))
-		for (i = 0; i < adpt->nr_vec; i++)
-			alx_mask_msix(hw, i, false);
-#endif
+	if (sc->alx_rx_buf_tag != NULL) {
+		bus_dma_tag_destroy(sc->alx_rx_buf_tag);
+		sc->alx_rx_buf_tag = NULL;
+	}
+	if (sc->alx_tx_buf_tag != NULL) {
+		bus_dma_tag_destroy(sc->alx_tx_buf_tag);
+		sc->alx_tx_buf_tag = NULL;
+	}
+	if (sc->alx_parent_tag != NULL) {
+		bus_dma_tag_destroy(sc->alx_parent_tag);
+		sc->alx_parent_tag = NULL;
+	}
 }
 
-static void
-alx_intr_disable(struct alx_softc *sc)
+/*
+ * Change the number of TX and RX descriptors. The rings are quiesced, freed
+ * and reallocated, and the interface is brought back up if it was running. If
+ * the new rings can't be allocated, the old sizes are restored.
+ */
+static int
+alx_resize_rings(struct alx_softc *sc, int txsz, int rxsz)
 {
-	struct alx_hw *hw = &sc->hw;
+	struct ifnet *ifp;
+	int error, otxsz, orxsz;
+	bool running;
 
-	ALX_MEM_W32(hw, ALX_ISR, ALX_ISR_DIS);
-	ALX_MEM_W32(hw, ALX_IMR, 0);
-	ALX_MEM_FLUSH(hw);
+	ALX_LOCK_ASSERT(sc);
 
-#ifdef __notyet
-	int i;
-	if (ALX_FLAG(sc, USING_MSIX))
-		for (i = 0; i < sc->nr_vec; i++)
-			alx_mask_msix(hw, i, true);
+	if (txsz == sc->tx_ringsz && rxsz == sc->rx_ringsz)
+		return (0);
+
+	ifp = sc->alx_ifp;
+#ifdef DEV_NETMAP
+	/* The netmap rings can't change size under an attached client. */
+	if ((ifp->if_capenable & IFCAP_NETMAP) != 0)
+		return (EBUSY);
 #endif
+	running = (ifp->if_drv_flags & IFF_DRV_RUNNING) != 0;
+	if (running)
+		alx_stop(sc);
+
+	otxsz = sc->tx_ringsz;
+	orxsz = sc->rx_ringsz;
+
+	alx_dma_free_rings(sc);
+	sc->tx_ringsz = txsz;
+	sc->rx_ringsz = rxsz;
+	error = alx_dma_alloc_rings(sc, BUS_DMA_NOWAIT);
+	if (error != 0) {
+		device_printf(sc->alx_dev,
+		    "could not allocate %d TX/%d RX descriptors, reverting\n",
+		    txsz, rxsz);
+		sc->tx_ringsz = otxsz;
+		sc->rx_ringsz = orxsz;
+		if (alx_dma_alloc_rings(sc, BUS_DMA_NOWAIT) != 0) {
+			device_printf(sc->alx_dev,
+			    "could not reallocate descriptor rings\n");
+			return (error);
+		}
+	}
+	sc->hw.ith_tpd = sc->tx_ringsz / 3;
+
+	if (running)
+		alx_init_locked(sc);
+
+	return (error);
 }
 
 static int
-alx_identify_hw(struct alx_softc *sc)
+alx_sysctl_ring_size(SYSCTL_HANDLER_ARGS)
 {
-	device_t dev = sc->alx_dev;
-	struct alx_hw *hw = &sc->hw;
-	int rev;
-
-	hw->device_id = pci_get_device(dev);
-	hw->subdev_id = pci_get_subdevice(dev);
-	hw->subven_id = pci_get_subvendor(dev);
-	hw->revision = pci_get_revid(dev);
-	rev = ALX_REVID(hw);
+	struct alx_softc *sc;
+	int error, size;
 
-	switch (ALX_DID(hw)) {
-	case ALX_DEV_ID_AR8161:
-	case ALX_DEV_ID_AR8162:
-	case ALX_DEV_ID_AR8171:
-	case ALX_DEV_ID_AR8172:
-		if (rev > ALX_REV_C0)
-			break;
-		ALX_CAP_SET(hw, L0S);
-		ALX_CAP_SET(hw, L1);
-		ALX_CAP_SET(hw, MTQ);
-		ALX_CAP_SET(hw, RSS);
-		ALX_CAP_SET(hw, MSIX);
-		ALX_CAP_SET(hw, SWOI);
-		hw->max_dma_chnl = rev >= ALX_REV_B0 ? 4 : 2;
-		if (rev < ALX_REV_C0) {
-			hw->ptrn_ofs = 0x600;
-			hw->max_ptrns = 8;
-		} else {
-			hw->ptrn_ofs = 0x14000;
-			hw->max_ptrns = 16;
-		}
-		break;
-	default:
+	sc = arg1;
+	size = arg2 == ALX_RING_TX ? sc->tx_ringsz : sc->rx_ringsz;
+	error = sysctl_handle_int(oidp, &size, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (size < ALX_MIN_RING_SZ || size > ALX_MAX_RING_SZ)
 		return (EINVAL);
-	}
 
-	if (ALX_DID(hw) & 1)
-		ALX_CAP_SET(hw, GIGA);
+	ALX_LOCK(sc);
+	if (arg2 == ALX_RING_TX)
+		error = alx_resize_rings(sc, size, sc->rx_ringsz);
+	else
+		error = alx_resize_rings(sc, sc->tx_ringsz, size);
+	ALX_UNLOCK(sc);
 
-	return (0);
+	return (error);
 }
 
-static const u8 def_rss_key[40] = {
-	0xE2, 0x91, 0xD7, 0x3D, 0x18, 0x05, 0xEC, 0x6C,
-	0x2A, 0x94, 0xB3, 0x0D, 0xA5, 0x4F, 0x2B, 0xEC,
-	0xEA, 0x49, 0xAF, 0x7C, 0xE2, 0x14, 0xAD, 0x3D,
-	0xB8, 0x55, 0xAA, 0xBE, 0x6A, 0x3E, 0x67, 0xEA,
-	0x14, 0x36, 0x4D, 0x17, 0x3B, 0xED, 0x20, 0x0D,
-};
-
-/* alx_init_adapter -
- *    initialize general software structure (struct alx_adapter).
- *    fields are inited based on PCI device information.
- */
 static int
-alx_init_sw(struct alx_softc *sc)
+alx_sysctl_process_limit(SYSCTL_HANDLER_ARGS)
 {
-	device_t dev = sc->alx_dev;
-	struct alx_hw *hw = &sc->hw;
-	int i, err;
+	struct alx_softc *sc;
+	int error, limit;
+
+	sc = arg1;
+	limit = sc->alx_process_limit;
+	error = sysctl_handle_int(oidp, &limit, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (limit <= 0)
+		return (EINVAL);
+	sc->alx_process_limit = limit;
+
+	return (0);
+}
+
+static int
+alx_sysctl_rss_key(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	char buf[2 * ALX_RSS_KEY_SIZE + 1];
+	uint8_t key[ALX_RSS_KEY_SIZE];
+	int c, error, i;
+
+	sc = arg1;
+
+	ALX_LOCK(sc);
+	for (i = 0; i < ALX_RSS_KEY_SIZE; i++)
+		snprintf(&buf[2 * i], 3, "%02x", sc->hw.rss_key[i]);
+	ALX_UNLOCK(sc);
+
+	error = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (strlen(buf) != 2 * ALX_RSS_KEY_SIZE)
+		return (EINVAL);
+
+	for (i = 0; i < 2 * ALX_RSS_KEY_SIZE; i++) {
+		c = buf[i];
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if (c >= 'a' && c <= 'f')
+			c -= 'a' - 10;
+		else if (c >= 'A' && c <= 'F')
+			c -= 'A' - 10;
+		else
+			return (EINVAL);
+		if (i % 2 == 0)
+			key[i / 2] = c << 4;
+		else
+			key[i / 2] |= c;
+	}
+
+	ALX_LOCK(sc);
+	memcpy(sc->hw.rss_key, key, ALX_RSS_KEY_SIZE);
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+		alx_reconfigure(sc);
+	ALX_UNLOCK(sc);
+
+	return (0);
+}
+
+/*
+ * The indirection table as a space-separated list of RX queue numbers, one
+ * per entry.
+ */
+static int
+alx_sysctl_rss_indir(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+	char buf[4 * ALX_RSS_IDT_MAX], *p, *end;
+	uint8_t idt[ALX_RSS_IDT_MAX];
+	u_long q;
+	int error, i, len;
+
+	sc = arg1;
+	hw = &sc->hw;
+
+	ALX_LOCK(sc);
+	for (i = len = 0; i < hw->rss_idt_size; i++)
+		len += snprintf(&buf[len], sizeof(buf) - len, "%s%u",
+		    i == 0 ? "" : " ", ALX_RSS_IDT_GET(hw, i));
+	ALX_UNLOCK(sc);
+
+	error = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	p = buf;
+	for (i = 0; i < hw->rss_idt_size; i++) {
+		while (*p == ' ')
+			p++;
+		q = strtoul(p, &end, 10);
+		if (end == p || q >= sc->nr_rxq)
+			return (EINVAL);
+		idt[i] = q;
+		p = end;
+	}
+	while (*p == ' ')
+		p++;
+	if (*p != '\0')
+		return (EINVAL);
+
+	ALX_LOCK(sc);
+	for (i = 0; i < hw->rss_idt_size; i++)
+		ALX_RSS_IDT_SET(hw, i, idt[i]);
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+		alx_reconfigure(sc);
+	ALX_UNLOCK(sc);
+
+	return (0);
+}
+
+static int
+alx_sysctl_rss_hash_types(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	int error, types;
+
+	sc = arg1;
+	types = sc->hw.rss_hash_type;
+	error = sysctl_handle_int(oidp, &types, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if ((types & ~ALX_RSS_HASH_TYPE_ALL) != 0)
+		return (EINVAL);
+
+	ALX_LOCK(sc);
+	sc->hw.rss_hash_type = types;
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+		alx_reconfigure(sc);
+	ALX_UNLOCK(sc);
+
+	return (0);
+}
+
+static int
+alx_sysctl_bql_limit(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	char buf[12 * ALX_MAX_TX_QUEUES];
+	int i, len;
+
+	sc = arg1;
+	buf[0] = '\0';
+	for (i = len = 0; i < sc->nr_txq; i++)
+		len += snprintf(&buf[len], sizeof(buf) - len, "%s%u",
+		    i == 0 ? "" : " ", sc->alx_txq[i].bql_limit);
+
+	return (sysctl_handle_string(oidp, buf, sizeof(buf), req));
+}
+
+static int
+alx_sysctl_tx_copy_thresh(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	int error, thresh;
+
+	sc = arg1;
+	thresh = sc->alx_tx_copy_thresh;
+	error = sysctl_handle_int(oidp, &thresh, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (thresh < 0 || thresh > ALX_TX_COPY_SZ)
+		return (EINVAL);
+	sc->alx_tx_copy_thresh = thresh;
+
+	return (0);
+}
+
+static int
+alx_sysctl_prio_map(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	char buf[4 * nitems(sc->alx_prio_map)], *p, *end;
+	uint8_t map[nitems(sc->alx_prio_map)];
+	u_long q;
+	int error, i, len;
+
+	sc = arg1;
+
+	for (i = len = 0; i < nitems(sc->alx_prio_map); i++)
+		len += snprintf(&buf[len], sizeof(buf) - len, "%s%u",
+		    i == 0 ? "" : " ", sc->alx_prio_map[i]);
+
+	error = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	p = buf;
+	for (i = 0; i < nitems(map); i++) {
+		while (*p == ' ')
+			p++;
+		q = strtoul(p, &end, 10);
+		if (end == p || q >= sc->nr_txq)
+			return (EINVAL);
+		map[i] = q;
+		p = end;
+	}
+	while (*p == ' ')
+		p++;
+	if (*p != '\0')
+		return (EINVAL);
+
+	/* alx_transmit() reads the map unlocked; entries change one by one. */
+	for (i = 0; i < nitems(map); i++)
+		sc->alx_prio_map[i] = map[i];
+
+	return (0);
+}
+
+static int
+alx_sysctl_wrr(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	struct alx_hw *hw;
+	char buf[4 * ALX_MAX_TX_QUEUES], *p, *end;
+	u32 wrr[ALX_MAX_TX_QUEUES];
+	u_long w;
+	int error, i, len;
+
+	sc = arg1;
+	hw = &sc->hw;
+
+	ALX_LOCK(sc);
+	for (i = len = 0; i < ARRAY_SIZE(hw->wrr); i++)
+		len += snprintf(&buf[len], sizeof(buf) - len, "%s%u",
+		    i == 0 ? "" : " ", hw->wrr[i]);
+	ALX_UNLOCK(sc);
+
+	error = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	p = buf;
+	for (i = 0; i < ARRAY_SIZE(wrr); i++) {
+		while (*p == ' ')
+			p++;
+		w = strtoul(p, &end, 10);
+		if (end == p || w > ALX_WRR_PRI0_MASK)
+			return (EINVAL);
+		wrr[i] = w;
+		p = end;
+	}
+	while (*p == ' ')
+		p++;
+	if (*p != '\0')
+		return (EINVAL);
+
+	ALX_LOCK(sc);
+	memcpy(hw->wrr, wrr, sizeof(hw->wrr));
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+		alx_configure_wrr(hw);
+	ALX_UNLOCK(sc);
+
+	return (0);
+}
+
+static int
+alx_sysctl_wrr_strict(SYSCTL_HANDLER_ARGS)
+{
+	struct alx_softc *sc;
+	int error, i, strict;
+
+	sc = arg1;
+
+	ALX_LOCK(sc);
+	for (i = 0; i < nitems(alx_wrr_strict); i++)
+		if (alx_wrr_strict[i] == sc->hw.wrr_ctrl)
+			break;
+	strict = i;
+	ALX_UNLOCK(sc);
+
+	error = sysctl_handle_int(oidp, &strict, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (strict < 0 || strict >= nitems(alx_wrr_strict))
+		return (EINVAL);
+
+	ALX_LOCK(sc);
+	sc->hw.wrr_ctrl = alx_wrr_strict[strict];
+	if ((sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+		alx_configure_wrr(&sc->hw);
+	ALX_UNLOCK(sc);
+
+	return (0);
+}
+
+static void
+alx_sysctl_attach(struct alx_softc *sc)
+{
+	struct sysctl_ctx_list *ctx;
+	struct sysctl_oid_list *children;
+
+	ctx = device_get_sysctl_ctx(sc->alx_dev);
+	children = SYSCTL_CHILDREN(device_get_sysctl_tree(sc->alx_dev));
+
+	SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "tx_ring_size",
+	    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, ALX_RING_TX,
+	    alx_sysctl_ring_size, "I", "Number of TX descriptors");
+	SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "rx_ring_size",
+	    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, ALX_RING_RX,
+	    alx_sysctl_ring_size, "I", "Number of RX descriptors");
+	SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "process_limit",
+	    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+	    alx_sysctl_process_limit, "I",
+	    "Max number of frames received per pass");
+	SYSCTL_ADD_INT(ctx, children, OID_AUTO, "intr_cpu", CTLFLAG_RD,
+	    &sc->alx_intr_cpu, 0,
+	    "CPU the interrupt and its taskqueue are bound to (-1 for none)");
+	if (ALX_CAP(&sc->hw, RSS)) {
+		SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "rss_key",
+		    CTLTYPE_STRING | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+		    alx_sysctl_rss_key, "A", "RSS hash key, in hex");
+		SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "rss_indir",
+		    CTLTYPE_STRING | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+		    alx_sysctl_rss_indir, "A",
+		    "RSS indirection table (RX queue per entry)");
+		SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "rss_hash_types",
+		    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+		    alx_sysctl_rss_hash_types, "I",
+		    "RSS hash types (1 IPv4, 2 TCP/IPv4, 4 IPv6, 8 TCP/IPv6)");
+	}
+	SYSCTL_ADD_INT(ctx, children, OID_AUTO, "soft_rss_queues", CTLFLAG_RD,
+	    &sc->alx_nsrss, 0, "Software receive steering queues");
+	SYSCTL_ADD_INT(ctx, children, OID_AUTO, "keep_link", CTLFLAG_RW,
+	    &sc->alx_keep_link, 0,
+	    "Keep the PHY link up while the interface is down");
+	SYSCTL_ADD_INT(ctx, children, OID_AUTO, "tx_bql_max", CTLFLAG_RW,
+	    &sc->alx_bql_max, 0,
+	    "Upper bound for the TX byte queue limit (0 to disable)");
+	SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "tx_copy_thresh",
+	    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+	    alx_sysctl_tx_copy_thresh, "I",
+	    "Largest frame copied into a pre-mapped TX buffer (0 to disable)");
+	SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "tx_bql_limit",
+	    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE, sc, 0,
+	    alx_sysctl_bql_limit, "A", "Current byte limit of each TX queue");
+	if (sc->nr_txq > 1) {
+		SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "tx_prio_map",
+		    CTLTYPE_STRING | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+		    alx_sysctl_prio_map, "A",
+		    "TX priority ring for each 802.1p priority 0-7");
+		SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "tx_wrr",
+		    CTLTYPE_STRING | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+		    alx_sysctl_wrr, "A", "WRR weight (0-31) of each TX ring");
+		SYSCTL_ADD_PROC(ctx, children, OID_AUTO, "tx_wrr_strict",
+		    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+		    alx_sysctl_wrr_strict, "I",
+		    "Highest-priority TX rings served strictly (0-3, 3 for all)");
+	}
+	SYSCTL_ADD_U64(ctx, children, OID_AUTO, "rx_resyncs", CTLFLAG_RD,
+	    &sc->alx_rx_queue.resyncs, 0,
+	    "RX descriptors dropped to resynchronise with the hardware");
+	SYSCTL_ADD_U64(ctx, children, OID_AUTO, "rx_resets", CTLFLAG_RD,
+	    &sc->alx_rx_queue.resets, 0, "RX queue resets");
+	SYSCTL_ADD_U64(ctx, children, OID_AUTO, "rx_pfil_drops", CTLFLAG_RD,
+	    &sc->alx_rx_queue.pfil_drops, 0,
+	    "RX frames dropped or consumed by pfil hooks");
+}
+
+static void
+alx_intr_enable(struct alx_softc *sc)
+{
+	struct alx_hw *hw;
+
+	hw = &sc->hw;
+
+	/* level-1 interrupt switch */
+	ALX_MEM_W32(hw, ALX_ISR, 0);
+	ALX_MEM_W32(hw, ALX_IMR, hw->imask);
+	ALX_MEM_FLUSH(hw);
+
+#ifdef __notyet
+	int i;
+	/* enable all individual MSIX IRQs */
+	if (ALX_FLAG(sc, USING_MSIX))
+		for (i = 0; i < adpt->nr_vec; i++)
+			alx_mask_msix(hw, i, false);
+#endif
+}
+
+static void
+alx_intr_disable(struct alx_softc *sc)
+{
+	struct alx_hw *hw = &sc->hw;
+
+	ALX_MEM_W32(hw, ALX_ISR, ALX_ISR_DIS);
+	ALX_MEM_W32(hw, ALX_IMR, 0);
+	ALX_MEM_FLUSH(hw);
+
+#ifdef __notyet
+	int i;
+	if (ALX_FLAG(sc, USING_MSIX))
+		for (i = 0; i < sc->nr_vec; i++)
+			alx_mask_msix(hw, i, true);
+#endif
+}
+
+static int
+alx_identify_hw(struct alx_softc *sc)
+{
+	device_t dev = sc->alx_dev;
+	struct alx_hw *hw = &sc->hw;
+	int rev;
+
+	hw->device_id = pci_get_device(dev);
+	hw->subdev_id = pci_get_subdevice(dev);
+	hw->subven_id = pci_get_subvendor(dev);
+	hw->revision = pci_get_revid(dev);
+	rev = ALX_REVID(hw);
+
+	switch (ALX_DID(hw)) {
+	case ALX_DEV_ID_AR8161:
+	case ALX_DEV_ID_AR8162:
+	case ALX_DEV_ID_AR8171:
+	case ALX_DEV_ID_AR8172:
+		if (rev > ALX_REV_C0)
+			break;
+		ALX_CAP_SET(hw, L0S);
+		ALX_CAP_SET(hw, L1);
+		ALX_CAP_SET(hw, MTQ);
+		ALX_CAP_SET(hw, RSS);
+		ALX_CAP_SET(hw, MSIX);
+		ALX_CAP_SET(hw, SWOI);
+		hw->max_dma_chnl = rev >= ALX_REV_B0 ? 4 : 2;
+		if (rev < ALX_REV_C0) {
+			hw->ptrn_ofs = 0x600;
+			hw->max_ptrns = 8;
+		} else {
+			hw->ptrn_ofs = 0x14000;
+			hw->max_ptrns = 16;
+		}
+		break;
+	default:
+		return (EINVAL);
+	}
+
+	if (ALX_DID(hw) & 1)
+		ALX_CAP_SET(hw, GIGA);
+
+	return (0);
+}
+
+#ifndef RSS
+static const u8 def_rss_key[ALX_RSS_KEY_SIZE] = {
+	0xE2, 0x91, 0xD7, 0x3D, 0x18, 0x05, 0xEC, 0x6C,
+	0x2A, 0x94, 0xB3, 0x0D, 0xA5, 0x4F, 0x2B, 0xEC,
+	0xEA, 0x49, 0xAF, 0x7C, 0xE2, 0x14, 0xAD, 0x3D,
+	0xB8, 0x55, 0xAA, 0xBE, 0x6A, 0x3E, 0x67, 0xEA,
+	0x14, 0x36, 0x4D, 0x17, 0x3B, 0xED, 0x20, 0x0D,
+};
+#endif
+
+/* alx_init_adapter -
+ *    initialize general software structure (struct alx_adapter).
+ *    fields are inited based on PCI device information.
+ */
+static int
+alx_init_sw(struct alx_softc *sc)
+{
+	device_t dev = sc->alx_dev;
+	struct alx_hw *hw = &sc->hw;
+	int i, err;
 
 	err = alx_identify_hw(sc);
 	if (err) {
@@ -513,15 +1239,23 @@ alx_init_sw(struct alx_softc *sc)
 	/* assign patch flag for specific platforms */
 	alx_patch_assign(hw);
 
-	memcpy(hw->rss_key, def_rss_key, sizeof(def_rss_key));
 	hw->rss_idt_size = 128;
-	hw->rss_hash_type = ALX_RSS_HASH_TYPE_ALL;
 	hw->smb_timer = 400;
-	sc->tx_ringsz = 256;
-	sc->rx_ringsz = 512;
+	sc->tx_ringsz = alx_tx_ring_size;
+	if (sc->tx_ringsz < ALX_MIN_RING_SZ || sc->tx_ringsz > ALX_MAX_RING_SZ) {
+		device_printf(dev, "invalid TX ring size %d, using %d\n",
+		    sc->tx_ringsz, ALX_DEF_TX_RING_SZ);
+		sc->tx_ringsz = ALX_DEF_TX_RING_SZ;
+	}
+	sc->rx_ringsz = alx_rx_ring_size;
+	if (sc->rx_ringsz < ALX_MIN_RING_SZ || sc->rx_ringsz > ALX_MAX_RING_SZ) {
+		device_printf(dev, "invalid RX ring size %d, using %d\n",
+		    sc->rx_ringsz, ALX_DEF_RX_RING_SZ);
+		sc->rx_ringsz = ALX_DEF_RX_RING_SZ;
+	}
 	hw->sleep_ctrl = ALX_SLEEP_WOL_MAGIC | ALX_SLEEP_WOL_PHY;
 	hw->imt = 200;
-	hw->imask = ALX_ISR_MISC;
+	hw->imask = ALX_ISR_MISC | ALX_ISR_TXQ_TO;
 	hw->dma_chnl = hw->max_dma_chnl;
 	hw->ith_tpd = sc->tx_ringsz / 3;
 	hw->link_up = false;
@@ -551,8 +1285,10 @@ alx_init_rx_ring(struct alx_softc *sc)
 {
 	struct alx_hw *hw;
 	int i, error;
+	bool nm;
 
 	ALX_LOCK_ASSERT(sc);
+	ALX_RX_LOCK_ASSERT(&sc->alx_rx_queue);
 
 	hw = &sc->hw;
 
@@ -563,19 +1299,24 @@ alx_init_rx_ring(struct alx_softc *sc)
 	sc->alx_rx_queue.c_reg = ALX_RFD_CIDX;
 	sc->alx_rx_queue.qidx = 0;
 	sc->alx_rx_queue.count = sc->rx_ringsz;
+	alx_size_rx_queues(sc);
 
 	hw->imask |= ALX_ISR_RX_Q0;
 
-	/* XXX the rings are all supposed to come from the same 4GB block. */
-	ALX_MEM_W32(hw, ALX_RX_BASE_ADDR_HI, sc->alx_rx_queue.rfd_dma >> 32);
+	/* All rings share the upper 32 bits of the ring header address. */
+	ALX_MEM_W32(hw, ALX_RX_BASE_ADDR_HI, sc->ring_header.busaddr >> 32);
 	ALX_MEM_W32(hw, ALX_RRD_ADDR_LO, sc->alx_rx_queue.rrd_dma);
 	ALX_MEM_W32(hw, ALX_RFD_ADDR_LO, sc->alx_rx_queue.rfd_dma);
 	ALX_MEM_W32(hw, ALX_RRD_RING_SZ, sc->rx_ringsz);
 	ALX_MEM_W32(hw, ALX_RFD_RING_SZ, sc->rx_ringsz);
 	ALX_MEM_W32(hw, ALX_RFD_BUF_SZ, sc->rxbuf_size);
 
+	nm = false;
+#ifdef DEV_NETMAP
+	nm = alx_netmap_init_rx(sc);
+#endif
 	/* XXX multiple queues. */
-	for (i = 0; i < sc->rx_ringsz; i++) {
+	for (i = 0; !nm && i < sc->rx_ringsz; i++) {
 		error = alx_newbuf(sc, i);
 		if (error != 0) {
 			/* XXX this needs to be handled better. */
@@ -586,162 +1327,602 @@ alx_init_rx_ring(struct alx_softc *sc)
 
 	ALX_MEM_W16(hw, ALX_RFD_PIDX, sc->rx_ringsz - 1);
 
-	bus_dmamap_sync(sc->alx_rx_tag, sc->alx_rx_dmamap,
-	    BUS_DMASYNC_PREWRITE);
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
+	    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+}
+
+/*
+ * The LRO context and the software steering queues are sized after the RX
+ * ring, which may have been resized since they were last set up.
+ */
+static void
+alx_size_rx_queues(struct alx_softc *sc)
+{
+	struct alx_rx_queue *rxq;
+	struct alx_srss *q;
+	struct ifnet *ifp;
+	int i;
+
+	ALX_LOCK_ASSERT(sc);
+	ALX_RX_LOCK_ASSERT(&sc->alx_rx_queue);
+
+	rxq = &sc->alx_rx_queue;
+	ifp = sc->alx_ifp;
+	if (rxq->lro.ifp != NULL && rxq->lro.lro_mbuf_max != sc->rx_ringsz) {
+		/* The rings are stopped, so nothing is held for aggregation. */
+		tcp_lro_free(&rxq->lro);
+		if (tcp_lro_init_args(&rxq->lro, ifp, TCP_LRO_ENTRIES,
+		    sc->rx_ringsz) != 0) {
+			device_printf(sc->alx_dev,
+			    "could not resize LRO, disabling it\n");
+			rxq->lro.ifp = NULL;
+			ifp->if_capabilities &= ~IFCAP_LRO;
+			ifp->if_capenable &= ~IFCAP_LRO;
+		}
+	}
+
+	for (i = 0; i < sc->alx_nsrss; i++) {
+		q = &sc->alx_srss[i];
+		mtx_lock(&q->mtx);
+		q->mq.mq_maxlen = sc->rx_ringsz;
+		mtx_unlock(&q->mtx);
+	}
 }
 
 static void
 alx_init_tx_ring(struct alx_softc *sc)
 {
 	struct alx_hw *hw;
+	struct alx_tx_queue *txq;
 	struct alx_buffer *tx_buf;
-	int i;
+	int i, q;
 
 	ALX_LOCK_ASSERT(sc);
 
-	hw = &sc->hw;
+	hw = &sc->hw;
+
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_txq[q];
+		ALX_TX_LOCK(txq);
+		txq->pidx = 0;
+		txq->p_reg = alx_txq_regs[q].pidx;
+		txq->cidx = 0;
+		txq->c_reg = alx_txq_regs[q].cidx;
+		txq->qidx = q;
+		txq->count = sc->tx_ringsz;
+		txq->bql_posted = txq->bql_completed = 0;
+		txq->bql_limit = ALX_BQL_MIN;
+		txq->bql_stopped = false;
+		txq->bql_slack = UINT_MAX;
+		txq->bql_slack_start = ticks;
+
+		hw->imask |= alx_txq_regs[q].intr;
+
+		for (i = 0; i < sc->tx_ringsz; i++) {
+			tx_buf = &txq->bf_info[i];
+			tx_buf->m = NULL;
+			tx_buf->len = 0;
+		}
+#ifdef DEV_NETMAP
+		alx_netmap_init_tx(sc, txq);
+#endif
+
+		ALX_MEM_W32(hw, alx_txq_regs[q].addr_lo, txq->tpd_dma);
+		/* Not cleared for us if the MAC was not reset. */
+		ALX_MEM_W16(hw, txq->p_reg, 0);
+		ALX_TX_UNLOCK(txq);
+	}
+
+	ALX_MEM_W32(hw, ALX_TX_BASE_ADDR_HI, sc->ring_header.busaddr >> 32);
+	ALX_MEM_W32(hw, ALX_TPD_RING_SZ, sc->tx_ringsz);
+	ALX_MEM_W32(hw, ALX_TINT_TPD_THRSHLD, hw->ith_tpd);
+}
+
+/*
+ * Receive up to limit frames. Returns true if the limit was hit and there
+ * may be more work to do.
+ *
+ * Each RRD names the first RFD of its frame and the number of RFDs used.
+ * If that does not match what we expect, the frame is dropped and we
+ * resynchronise on the RFD index the hardware reported; the buffers skipped
+ * over keep their mbufs and are simply reposted. If the RRD is nonsense or
+ * this keeps happening, stop and resynchronise the whole RX queue.
+ */
+static bool
+alx_rxintr(struct alx_softc *sc, int limit)
+{
+	struct mbuf *m;
+	struct ifnet *ifp;
+	struct alx_rx_queue *rxq;
+	struct alx_buffer *rx_buf;
+	struct rrd_desc *rrd;
+	int rrd_cidx, rfd_cidx, rfd_pidx, si, nor, next, count, resyncs;
+	int hashtype, len;
+	bool lro_queued, more, reset;
+#ifdef DEV_NETMAP
+	u_int work;
+#endif
+
+	rxq = &sc->alx_rx_queue;
+	ALX_RX_LOCK_ASSERT(rxq);
+
+	ifp = sc->alx_ifp;
+
+#ifdef DEV_NETMAP
+	if (netmap_rx_irq(ifp, rxq->qidx, &work) != NM_IRQ_PASS)
+		return (false);
+#endif
+
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
+	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
+
+	count = resyncs = 0;
+	lro_queued = more = reset = false;
+	rrd_cidx = rxq->rrd_cidx;
+	rfd_cidx = rxq->cidx;
+#if 0
+	printf("consuming packets starting at %d\n", rrd_cidx);
+#endif
+	while (1) {
+		if (count >= limit) {
+			more = true;
+			break;
+		}
+		rrd = &rxq->rrd_hdr[rrd_cidx];
+		if ((rrd->word3 & (1 << RRD_UPDATED_SHIFT)) == 0)
+			break;
+		rrd->word3 &= ~(1 << RRD_UPDATED_SHIFT);
+
+		/* Get the index of the corresponding RFD. */
+		si = FIELD_GETX(rrd->word0, RRD_SI);
+		nor = FIELD_GETX(rrd->word0, RRD_NOR);
+		if (si != rfd_cidx || nor != 1) {
+			if (si >= sc->rx_ringsz || nor == 0 ||
+			    nor > sc->rx_ringsz || ++resyncs > ALX_RX_RESYNC_MAX) {
+				device_printf(sc->alx_dev,
+				    "RX ring out of sync, resetting RX queue\n");
+				rxq->rrd_cidx = rrd_cidx;
+				rxq->cidx = rfd_cidx;
+				alx_rx_reset(sc);
+				rrd_cidx = rxq->rrd_cidx;
+				rfd_cidx = rxq->cidx;
+				/* Refill and repost below even if nothing moved. */
+				reset = true;
+				break;
+			}
+
+			/* Drop the frame and pick up where the hardware is. */
+			rxq->resyncs++;
+			if_inc_counter(ifp, IFCOUNTER_IQDROPS, 1);
+			rfd_cidx = (si + nor) % sc->rx_ringsz;
+			count++;
+			if (++rrd_cidx == sc->rx_ringsz)
+				rrd_cidx = 0;
+			continue;
+		}
+
+		/*
+		 * Start pulling in the next descriptor and the next frame's
+		 * header while this frame is handed up.
+		 */
+		next = rrd_cidx + 1 == sc->rx_ringsz ? 0 : rrd_cidx + 1;
+		prefetch(&rxq->rrd_hdr[next]);
+		next = rfd_cidx + 1 == sc->rx_ringsz ? 0 : rfd_cidx + 1;
+		if (rxq->bf_info[next].m != NULL)
+			prefetch(mtod(rxq->bf_info[next].m, void *));
+
+		rx_buf = &rxq->bf_info[rfd_cidx];
+		len = FIELD_GETX(rrd->word3, RRD_PKTLEN) - ETHER_CRC_LEN;
+		bus_dmamap_sync(sc->alx_rx_buf_tag, rx_buf->dmamap,
+		    BUS_DMASYNC_POSTREAD);
+
+		m = NULL;
+		if (ifp->if_pfil != NULL && PFIL_HOOKED_IN(ifp->if_pfil)) {
+			/*
+			 * Filter the frame where the hardware put it. Unless
+			 * it passes, the cluster stays in the ring and the
+			 * refill loop below posts it again as is.
+			 */
+			switch (pfil_run_hooks(ifp->if_pfil,
+			    mtod(rx_buf->m, void *), ifp,
+			    len | PFIL_MEMPTR | PFIL_IN, NULL)) {
+			case PFIL_PASS:
+				break;
+			case PFIL_REALLOCED:
+				/* The filter copied the frame out. */
+				m = pfil_mem2mbuf(mtod(rx_buf->m, void *));
+				bus_dmamap_sync(sc->alx_rx_buf_tag,
+				    rx_buf->dmamap, BUS_DMASYNC_PREREAD);
+				break;
+			default:
+				rxq->pfil_drops++;
+				bus_dmamap_sync(sc->alx_rx_buf_tag,
+				    rx_buf->dmamap, BUS_DMASYNC_PREREAD);
+				count++;
+				if (++rrd_cidx == sc->rx_ringsz)
+					rrd_cidx = 0;
+				if (++rfd_cidx == sc->rx_ringsz)
+					rfd_cidx = 0;
+				continue;
+			}
+		}
+		if (m == NULL) {
+			m = rx_buf->m;
+			rx_buf->m = NULL;
+			m->m_flags |= M_PKTHDR;
+			m->m_len = len;
+		}
+		m->m_pkthdr.len = len;
+		m->m_pkthdr.rcvif = ifp;
+		if ((ifp->if_capenable & IFCAP_RXCSUM) != 0)
+			alx_rx_csum(m, rrd);
+		hashtype = alx_rx_hashtype(rrd->word2);
+		if (hashtype != M_HASHTYPE_NONE) {
+			m->m_pkthdr.flowid = le32toh(rrd->rss_hash);
+			M_HASHTYPE_SET(m, hashtype);
+		}
+		if ((rrd->word3 & (1 << RRD_VLTAGGED_SHIFT)) != 0 &&
+		    (ifp->if_capenable & IFCAP_VLAN_HWTAGGING) != 0) {
+			m->m_pkthdr.ether_vtag =
+			    ntohs(FIELD_GETX(rrd->word2, RRD_VLTAG));
+			m->m_flags |= M_VLANTAG;
+		}
+
+#if 0
+		printf("read a %d-byte packet\n", m->m_len);
+#endif
+
+		if (sc->alx_nsrss > 0) {
+			/* Hand the frame to another CPU; no need to unlock. */
+			alx_srss_enqueue(sc, m);
+		} else if ((ifp->if_capenable & IFCAP_LRO) != 0 &&
+		    (m->m_pkthdr.csum_flags & CSUM_DATA_VALID) != 0 &&
+		    tcp_lro_rx(&rxq->lro, m, 0) == 0) {
+			/* Held for aggregation; flushed below. */
+			lro_queued = true;
+		} else {
+			/* Pass the packet up the stack. */
+			ALX_RX_UNLOCK(rxq);
+			(*ifp->if_input)(ifp, m);
+			ALX_RX_LOCK(rxq);
+
+			/*
+			 * The rings may have been torn down while we were
+			 * unlocked.
+			 */
+			if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0) {
+				if (lro_queued)
+					tcp_lro_flush_all(&rxq->lro);
+				return (false);
+			}
+		}
+
+		count++;
+		if (++rrd_cidx == sc->rx_ringsz)
+			rrd_cidx = 0;
+		if (++rfd_cidx == sc->rx_ringsz)
+			rfd_cidx = 0;
+	}
+
+#if 0
+	printf("consumed %d packets\n", count);
+#endif
+
+	if (reset || rrd_cidx != rxq->rrd_cidx || rfd_cidx != rxq->cidx) {
+		rxq->rrd_cidx = rrd_cidx;
+		rxq->cidx = rfd_cidx;
+
+		/* Refresh mbufs; buffers that were skipped still have theirs. */
+		rfd_pidx = rxq->pidx;
+		while (rfd_pidx != rfd_cidx) {
+#if 0
+			printf("refreshing mbuf at %d\n", rfd_pidx);
+#endif
+			if (rxq->bf_info[rfd_pidx].m == NULL &&
+			    alx_newbuf(sc, rfd_pidx) != 0)
+				break;
+			if (++rfd_pidx == sc->rx_ringsz)
+				rfd_pidx = 0;
+		}
+		rxq->pidx = rfd_pidx;
+		ALX_MEM_W16(&sc->hw, ALX_RFD_PIDX, rfd_pidx);
+
+		/* Sync receive descriptors. */
+		bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
+		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+	}
+
+	/*
+	 * The RX lock protects the LRO state; alx_rxintr() can be entered
+	 * from both the interrupt thread and alx_int_task.
+	 */
+	if (lro_queued)
+		tcp_lro_flush_all(&rxq->lro);
+
+	return (more);
+}
+
+/*
+ * Translate the checksum results in the RRD. The hardware checks the IPv4
+ * header and TCP/UDP payload checksums and flags errors in word 3.
+ */
+static void
+alx_rx_csum(struct mbuf *m, struct rrd_desc *rrd)
+{
+	int pid;
+
+	pid = FIELD_GETX(rrd->word2, RRD_PID);
+	switch (pid) {
+	case RRD_PID_IPV4:
+	case RRD_PID_IPV4TCP:
+	case RRD_PID_IPV4UDP:
+		m->m_pkthdr.csum_flags |= CSUM_IP_CHECKED;
+		if ((rrd->word3 & (1 << RRD_ERR_IPV4_SHIFT)) == 0)
+			m->m_pkthdr.csum_flags |= CSUM_IP_VALID;
+		break;
+	}
+
+	switch (pid) {
+	case RRD_PID_IPV4TCP:
+	case RRD_PID_IPV4UDP:
+	case RRD_PID_IPV6TCP:
+	case RRD_PID_IPV6UDP:
+		if ((rrd->word3 & (1 << RRD_ERR_L4_SHIFT)) == 0) {
+			m->m_pkthdr.csum_flags |= CSUM_DATA_VALID |
+			    CSUM_PSEUDO_HDR;
+			m->m_pkthdr.csum_data = 0xffff;
+		}
+		break;
+	}
+}
+
+/*
+ * Map the hash algorithm reported in RRD word 2 to an mbuf hash type.
+ */
+static int
+alx_rx_hashtype(uint32_t word2)
+{
+
+	switch (FIELD_GETX(word2, RRD_RSSALG)) {
+	case RRD_RSSALG_TCPV4:
+		return (M_HASHTYPE_RSS_TCP_IPV4);
+	case RRD_RSSALG_IPV4:
+		return (M_HASHTYPE_RSS_IPV4);
+	case RRD_RSSALG_TCPV6:
+		return (M_HASHTYPE_RSS_TCP_IPV6);
+	case RRD_RSSALG_IPV6:
+		return (M_HASHTYPE_RSS_IPV6);
+	default:
+		return (M_HASHTYPE_NONE);
+	}
+}
+
+/*
+ * Set up one software receive steering queue per CPU, up to ALX_SRSS_MAX,
+ * each serviced by a taskqueue thread bound to that CPU.
+ */
+static void
+alx_srss_alloc(struct alx_softc *sc)
+{
+	struct alx_srss *q;
+	cpuset_t cpus;
+	int cpu, i;
+
+	if (!alx_soft_rss || mp_ncpus == 1)
+		return;
+
+	sc->alx_nsrss = min(mp_ncpus, ALX_SRSS_MAX);
+	sc->alx_srss = malloc(sc->alx_nsrss * sizeof(struct alx_srss),
+	    M_DEVBUF, M_WAITOK | M_ZERO);
+	sc->alx_srss_key = m_ether_tcpip_hash_init();
+
+	i = 0;
+	CPU_FOREACH(cpu) {
+		if (i == sc->alx_nsrss)
+			break;
+		q = &sc->alx_srss[i];
+		q->sc = sc;
+		mtx_init(&q->mtx, "alx srss", NULL, MTX_DEF);
+		mbufq_init(&q->mq, sc->rx_ringsz);
+		TASK_INIT(&q->task, 0, alx_srss_task, q);
+		q->tq = taskqueue_create_fast("alx_srss", M_WAITOK,
+		    taskqueue_thread_enqueue, &q->tq);
+		CPU_SETOF(cpu, &cpus);
+		taskqueue_start_threads_cpuset(&q->tq, 1, PI_NET, &cpus,
+		    "%s srss%d", device_get_nameunit(sc->alx_dev), i);
+		i++;
+	}
+	sc->alx_nsrss = i;
+}
+
+static void
+alx_srss_free(struct alx_softc *sc)
+{
+	struct alx_srss *q;
+	int i;
+
+	if (sc->alx_srss == NULL)
+		return;
+
+	for (i = 0; i < sc->alx_nsrss; i++) {
+		q = &sc->alx_srss[i];
+		taskqueue_drain(q->tq, &q->task);
+		taskqueue_free(q->tq);
+		mbufq_drain(&q->mq);
+		mtx_destroy(&q->mtx);
+	}
+	free(sc->alx_srss, M_DEVBUF);
+	sc->alx_srss = NULL;
+	sc->alx_nsrss = 0;
+}
+
+/*
+ * Queue a received frame on the CPU its flow hashes to. The hardware hash is
+ * used when there is one; otherwise hash the L3/L4 headers here.
+ */
+static void
+alx_srss_enqueue(struct alx_softc *sc, struct mbuf *m)
+{
+	struct alx_srss *q;
+	bool kick;
+	int error;
+
+	if (!M_HASHTYPE_ISHASH(m)) {
+		m->m_pkthdr.flowid = m_ether_tcpip_hash(MBUF_HASHFLAG_L3 |
+		    MBUF_HASHFLAG_L4, m, sc->alx_srss_key);
+		M_HASHTYPE_SET(m, M_HASHTYPE_OPAQUE_HASH);
+	}
+	q = &sc->alx_srss[m->m_pkthdr.flowid % sc->alx_nsrss];
+
+	/* The task empties the queue, so it only needs a kick when empty. */
+	mtx_lock(&q->mtx);
+	kick = mbufq_len(&q->mq) == 0;
+	error = mbufq_enqueue(&q->mq, m);
+	mtx_unlock(&q->mtx);
+	if (error != 0) {
+		m_freem(m);
+		if_inc_counter(sc->alx_ifp, IFCOUNTER_IQDROPS, 1);
+		return;
+	}
+	if (kick)
+		taskqueue_enqueue(q->tq, &q->task);
+}
+
+/*
+ * Pass queued frames up the stack on this CPU. ether_input() takes the whole
+ * chain and dispatches each frame through netisr from here.
+ */
+static void
+alx_srss_task(void *arg, int pending __unused)
+{
+	struct alx_srss *q;
+	struct ifnet *ifp;
+	struct mbuf *m, *n;
 
-	sc->alx_tx_queue.pidx = 0;
-	sc->alx_tx_queue.p_reg = ALX_TPD_PRI0_PIDX;
-	sc->alx_tx_queue.cidx = 0;
-	sc->alx_tx_queue.c_reg = ALX_TPD_PRI0_CIDX;
-	sc->alx_tx_queue.qidx = 0;
-	sc->alx_tx_queue.count = sc->tx_ringsz;
+	q = arg;
+	ifp = q->sc->alx_ifp;
 
-	hw->imask |= ALX_ISR_TX_Q0;
+	for (;;) {
+		mtx_lock(&q->mtx);
+		m = mbufq_flush(&q->mq);
+		mtx_unlock(&q->mtx);
+		if (m == NULL)
+			break;
 
-	for (i = 0; i < sc->tx_ringsz; i++) {
-		tx_buf = &sc->alx_tx_queue.bf_info[i];
-		tx_buf->m = NULL;
+		if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0) {
+			for (; m != NULL; m = n) {
+				n = m->m_nextpkt;
+				m->m_nextpkt = NULL;
+				m_freem(m);
+			}
+			continue;
+		}
+		(*ifp->if_input)(ifp, m);
 	}
-
-	/* XXX multiple queues */
-	ALX_MEM_W32(hw, ALX_TX_BASE_ADDR_HI, sc->alx_tx_queue.tpd_dma >> 32);
-	ALX_MEM_W32(hw, ALX_TPD_PRI0_ADDR_LO, sc->alx_tx_queue.tpd_dma);
-	ALX_MEM_W32(hw, ALX_TPD_RING_SZ, sc->tx_ringsz);
 }
 
+/*
+ * Bring the RX ring back in step with the hardware without touching TX or
+ * the link: stop the RX queue, drop whatever it already wrote back, adopt
+ * its RFD consumer index and restart it. If the queue will not stop, fall
+ * back to a full reset. Everything else that modifies RXQ0 while the
+ * interface runs does so under the RX lock as well.
+ */
 static void
-alx_rxintr(struct alx_softc *sc)
+alx_rx_reset(struct alx_softc *sc)
 {
-	struct mbuf *m;
-	struct ifnet *ifp;
-	struct alx_buffer *rx_buf;
+	struct alx_hw *hw;
+	struct alx_rx_queue *rxq;
 	struct rrd_desc *rrd;
-	int rrd_cidx, rfd_cidx, rrd_pidx, count;
+	uint32_t rxq0, val;
+	uint16_t cidx;
+	int i;
 
-	ALX_LOCK_ASSERT(sc);
+	hw = &sc->hw;
+	rxq = &sc->alx_rx_queue;
+	ALX_RX_LOCK_ASSERT(rxq);
+
+	ALX_MEM_R32(hw, ALX_RXQ0, &rxq0);
+	ALX_MEM_W32(hw, ALX_RXQ0, rxq0 & ~ALX_RXQ0_EN);
+	for (i = 0; i < ALX_DMA_MAC_RST_TO; i++) {
+		ALX_MEM_R32(hw, ALX_MAC_STS, &val);
+		if ((val & ALX_MAC_STS_RXQ_BUSY) == 0)
+			break;
+		DELAY(10);
+	}
+	if (i == ALX_DMA_MAC_RST_TO) {
+		device_printf(sc->alx_dev, "RX queue did not stop\n");
+		ALX_FLAG_SET(sc, TASK_RESET);
+		taskqueue_enqueue(sc->alx_link_tq, &sc->alx_reset_task);
+		return;
+	}
 
-	bus_dmamap_sync(sc->alx_rr_tag, sc->alx_rr_dmamap,
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
 	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
-	bus_dmamap_sync(sc->alx_rx_tag, sc->alx_rx_dmamap,
-	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
-
-	ifp = sc->alx_ifp;
 
-	count = 0;
-	rrd_cidx = sc->alx_rx_queue.cidx;
-#if 0
-	printf("consuming packets starting at %d\n", rrd_cidx);
-#endif
-	while (1) {
-		rrd = &sc->alx_rx_queue.rrd_hdr[rrd_cidx];
+	/*
+	 * The queue writes RRDs in order, so skipping every one it has
+	 * written leaves rrd_cidx where the next one will land.
+	 */
+	for (i = 0; i < sc->rx_ringsz; i++) {
+		rrd = &rxq->rrd_hdr[rxq->rrd_cidx];
 		if ((rrd->word3 & (1 << RRD_UPDATED_SHIFT)) == 0)
 			break;
 		rrd->word3 &= ~(1 << RRD_UPDATED_SHIFT);
-
-		/* Get the index of the corresponding RFD. */
-		rfd_cidx = FIELD_GETX(rrd->word0, RRD_SI);
-		if (rfd_cidx != rrd_cidx ||
-		    FIELD_GETX(rrd->word0, RRD_NOR) != 1) {
-			device_printf(sc->alx_dev,
-			    "RX consumer index mismatch: %d vs. %d, and %d\n",
-			    rrd_cidx, rfd_cidx,
-			    FIELD_GETX(rrd->word0, RRD_NOR));
-			/* XXX reset the chip? */
-			return;
-		}
-
-		rx_buf = &sc->alx_rx_queue.bf_info[rfd_cidx];
-		m = rx_buf->m;
-		rx_buf->m = NULL;
-
-		m->m_flags |= M_PKTHDR;
-		m->m_len = FIELD_GETX(rrd->word3, RRD_PKTLEN) - ETHER_CRC_LEN;
-		m->m_pkthdr.len = m->m_len;
-		m->m_pkthdr.rcvif = ifp;
-
-#if 0
-		printf("read a %d-byte packet\n", m->m_len);
-#endif
-
-		/* Pass the packet up the stack. */
-		ALX_UNLOCK(sc);
-		(*ifp->if_input)(ifp, m);
-		ALX_LOCK(sc);
-
-		count++;
-		if (++rrd_cidx == sc->rx_ringsz)
-			rrd_cidx = 0;
+		if_inc_counter(sc->alx_ifp, IFCOUNTER_IQDROPS, 1);
+		if (++rxq->rrd_cidx == sc->rx_ringsz)
+			rxq->rrd_cidx = 0;
 	}
 
-#if 0
-	printf("consumed %d packets\n", count);
-#endif
-
-	if (count > 0) {
-		sc->alx_rx_queue.cidx = rrd_cidx;
+	/*
+	 * RFDs up to the hardware's consumer index keep their mbufs and are
+	 * reposted by alx_rxintr().
+	 */
+	ALX_MEM_R16(hw, ALX_RFD_CIDX, &cidx);
+	cidx &= ALX_RFD_CIDX_MASK;
+	rxq->cidx = cidx < sc->rx_ringsz ? cidx : 0;
+	rxq->resets++;
 
-		/* Refresh mbufs. */
-		rrd_pidx = sc->alx_rx_queue.pidx;
-		while (rrd_pidx != rrd_cidx) {
-#if 0
-			printf("refreshing mbuf at %d\n", rrd_pidx);
-#endif
-			if (alx_newbuf(sc, rrd_pidx) != 0)
-				break;
-			if (++rrd_pidx == sc->rx_ringsz)
-				rrd_pidx = 0;
-		}
-		sc->alx_rx_queue.pidx = rrd_pidx;
-		ALX_MEM_W16(&sc->hw, ALX_RFD_PIDX, rrd_pidx);
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
+	    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
 
-		/* Sync receive descriptors. */
-		bus_dmamap_sync(sc->alx_rr_tag, sc->alx_rr_dmamap,
-		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
-		bus_dmamap_sync(sc->alx_rx_tag, sc->alx_rx_dmamap,
-		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
-	}
+	ALX_MEM_W32(hw, ALX_RXQ0, rxq0);
 }
 
 static void
-alx_txintr(struct alx_softc *sc)
+alx_txintr(struct alx_softc *sc, struct alx_tx_queue *txq)
 {
-	struct ifnet *ifp;
 	struct alx_buffer *tx_buf;
 	int tpd_cidx, tpd_hw_cidx;
+	u_int bytes;
 
-	ALX_LOCK_ASSERT(sc);
+	ALX_TX_LOCK_ASSERT(txq);
 
-	ifp = sc->alx_ifp;
+#ifdef DEV_NETMAP
+	if (netmap_tx_irq(sc->alx_ifp, txq->qidx) != NM_IRQ_PASS)
+		return;
+#endif
 
-	tpd_cidx = sc->alx_tx_queue.cidx;
-	ALX_MEM_R16(&sc->hw, ALX_TPD_PRI0_CIDX, &tpd_hw_cidx);
+	bytes = 0;
+	tpd_cidx = txq->cidx;
+	ALX_MEM_R16(&sc->hw, txq->c_reg, &tpd_hw_cidx);
 
 #if 0
 	printf("in txintr cidx is %d, hw_cidx is %d\n", tpd_cidx, tpd_hw_cidx);
 #endif
 
 	while (tpd_cidx != tpd_hw_cidx) {
-		tx_buf = &sc->alx_tx_queue.bf_info[tpd_cidx];
+		tx_buf = &txq->bf_info[tpd_cidx];
+		prefetch(&txq->bf_info[ALX_TX_INC(tpd_cidx, sc)]);
+		bytes += tx_buf->len;
+		tx_buf->len = 0;
 		if (tx_buf->m == NULL) {
+			/* Not the frame's last TPD, or a copied frame. */
 			if (++tpd_cidx == sc->tx_ringsz)
 				tpd_cidx = 0;
 			continue;
 		}
 
-		ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
-
 		/* Tear down the DMA mapping for the used mbuf. */
 		bus_dmamap_sync(sc->alx_tx_buf_tag, tx_buf->dmamap,
 		    BUS_DMASYNC_POSTWRITE);
@@ -754,7 +1935,50 @@ alx_txintr(struct alx_softc *sc)
 			tpd_cidx = 0;
 	}
 
-	sc->alx_tx_queue.cidx = tpd_cidx;
+	/* Any progress restarts the watchdog; an empty ring stops it. */
+	if (tpd_cidx != txq->cidx)
+		txq->watchdog_timer = tpd_cidx == txq->pidx ? 0 :
+		    ALX_WATCHDOG_TIME;
+	txq->cidx = tpd_cidx;
+	if (bytes != 0)
+		alx_bql_completed(sc, txq, bytes);
+}
+
+/*
+ * Account for completed bytes and adapt the queue's byte limit, along the
+ * lines of Linux's dynamic queue limits. If the hardware ran dry while
+ * alx_txq_drain() was holding frames back, the limit was too low and is
+ * raised by what just completed. If instead some backlog was still queued
+ * after every completion for a second, that much was never needed to keep
+ * the hardware busy, and the limit is lowered by it.
+ */
+static void
+alx_bql_completed(struct alx_softc *sc, struct alx_tx_queue *txq,
+    u_int bytes)
+{
+	u_int inflight, limit;
+
+	ALX_TX_LOCK_ASSERT(txq);
+
+	txq->bql_completed += bytes;
+	if (sc->alx_bql_max <= 0)
+		return;
+
+	inflight = ALX_BQL_INFLIGHT(txq);
+	limit = txq->bql_limit;
+	if (inflight == 0 && txq->bql_stopped) {
+		limit += bytes;
+		txq->bql_slack = UINT_MAX;
+		txq->bql_slack_start = ticks;
+	} else {
+		txq->bql_slack = min(txq->bql_slack, inflight);
+		if (ticks - txq->bql_slack_start >= hz) {
+			limit -= min(limit, txq->bql_slack);
+			txq->bql_slack = UINT_MAX;
+			txq->bql_slack_start = ticks;
+		}
+	}
+	txq->bql_limit = max(min(limit, (u_int)sc->alx_bql_max), ALX_BQL_MIN);
 }
 
 static int
@@ -788,25 +2012,26 @@ alx_newbuf(struct alx_softc *sc, int index)
 }
 
 static int
-alx_xmit(struct alx_softc *sc, struct mbuf **m_head)
+alx_xmit(struct alx_softc *sc, struct alx_tx_queue *txq, struct mbuf **m_head)
 {
 	struct mbuf *m;
 	bus_dma_segment_t segs[32];
 	bus_dmamap_t txmap;
 	struct tpd_desc *td;
 	struct alx_buffer *tx_buf, *tx_buf_mapped;
-	int desci, error, nsegs, i;
-	uint16_t cidx;
+	int desci, error, nsegs, i, last;
+	uint32_t flags, vtag;
 
-	ALX_LOCK_ASSERT(sc);
+	ALX_TX_LOCK_ASSERT(txq);
 
 	M_ASSERTPKTHDR(*m_head);
 
-	ALX_MEM_R16(&sc->hw, sc->alx_tx_queue.c_reg, &cidx);
+	if ((*m_head)->m_pkthdr.len <= sc->alx_tx_copy_thresh)
+		return (alx_xmit_copy(sc, txq, m_head));
 
-	desci = sc->alx_tx_queue.pidx;
-	tx_buf = tx_buf_mapped = &sc->alx_tx_queue.bf_info[desci];
-	txmap = tx_buf->dmamap;
+	desci = txq->pidx;
+	tx_buf_mapped = &txq->bf_info[desci];
+	txmap = tx_buf_mapped->dmamap;
 
 	error = bus_dmamap_load_mbuf_sg(sc->alx_tx_buf_tag, txmap, *m_head,
 	    segs, &nsegs, 0);
@@ -841,30 +2066,48 @@ alx_xmit(struct alx_softc *sc, struct mbuf **m_head)
 		return (EIO);
 	}
 
-	/* Make sure we have enough descriptors available. */
-	/* XXX what's up with the - 2? It's in em(4) and age(4). */
-	/* XXX count isn't ever modified. */
-	if (nsegs > sc->alx_tx_queue.count - 2) {
-		/* XXX increment counter? */
-		bus_dmamap_unload(sc->alx_tx_tag, txmap);
+	/*
+	 * Make sure we have enough descriptors available. One slot stays
+	 * empty so that a full ring can be told from an empty one. The
+	 * caller keeps the frame and retries once alx_txintr() has
+	 * reclaimed some.
+	 */
+	if (nsegs > (int)((txq->cidx + sc->tx_ringsz - desci - 1) %
+	    sc->tx_ringsz)) {
+		bus_dmamap_unload(sc->alx_tx_buf_tag, txmap);
 		return (ENOBUFS);
 	}
 
+	/* Every descriptor of the frame carries the VLAN tag. */
+	vtag = flags = 0;
+	if (((*m_head)->m_flags & M_VLANTAG) != 0) {
+		vtag = htons((*m_head)->m_pkthdr.ether_vtag) << TPD_VLTAG_SHIFT;
+		flags |= 1 << TPD_INS_VLTAG_SHIFT;
+	}
+
+	last = desci;
 	for (i = 0; i < nsegs; i++, desci = ALX_TX_INC(desci, sc)) {
-		td = &sc->alx_tx_queue.tpd_hdr[desci];
+		last = desci;
+		td = &txq->tpd_hdr[desci];
 		td->addr = htole64(segs[i].ds_addr);
-		td->len = htole32(segs[i].ds_len);
-		td->flags = 0;
+		td->len = htole32(segs[i].ds_len | vtag);
+		td->flags = flags;
 	}
 
 	/* This is the last descriptor for this packet. */
 	td->flags |= 1 << TPD_EOP_SHIFT;
 
 	/* Update the producer index. */
-	sc->alx_tx_queue.pidx = desci;
+	txq->pidx = desci;
 
-	/* Save the mbuf pointer so that we can unmap it later. */
+	/*
+	 * Save the mbuf pointer on the last descriptor, so that alx_txintr()
+	 * only frees it once the whole frame has been sent.
+	 */
+	tx_buf = &txq->bf_info[last];
 	tx_buf->m = *m_head;
+	tx_buf->len = (*m_head)->m_pkthdr.len;
+	txq->bql_posted += tx_buf->len;
 
 	/*
 	 * Swap the maps between the first and last descriptors so that the last
@@ -876,10 +2119,77 @@ alx_xmit(struct alx_softc *sc, struct mbuf **m_head)
 	bus_dmamap_sync(sc->alx_tx_buf_tag, txmap, BUS_DMASYNC_PREWRITE);
 
 	/* Let the hardware know that we're all set. */
-	bus_dmamap_sync(sc->alx_tx_tag, sc->alx_tx_dmamap,
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
+	    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+
+	ALX_MEM_W16(&sc->hw, txq->p_reg, desci);
+
+	/*
+	 * Arm the watchdog if the ring was idle; alx_txintr() rearms it on
+	 * progress and disarms it once the ring drains.
+	 */
+	if (txq->watchdog_timer == 0)
+		txq->watchdog_timer = ALX_WATCHDOG_TIME;
+
+	return (0);
+}
+
+/*
+ * Send a small frame by copying it into the descriptor's slot of the queue's
+ * pre-mapped copy area. This takes a single TPD and no DMA map load, and the
+ * mbuf is freed right away, so there is nothing to unload on reclaim. On
+ * success the frame has been passed to BPF and *m_head is set to NULL.
+ */
+static int
+alx_xmit_copy(struct alx_softc *sc, struct alx_tx_queue *txq,
+    struct mbuf **m_head)
+{
+	struct mbuf *m;
+	struct alx_buffer *tx_buf;
+	struct tpd_desc *td;
+	int desci, len;
+	uint32_t flags, vtag;
+
+	ALX_TX_LOCK_ASSERT(txq);
+
+	desci = txq->pidx;
+	if (ALX_TX_INC(desci, sc) == txq->cidx)
+		return (ENOBUFS);
+
+	m = *m_head;
+	len = m->m_pkthdr.len;
+	m_copydata(m, 0, len, txq->copy_buf + desci * ALX_TX_COPY_SZ);
+
+	vtag = 0;
+	flags = 1 << TPD_EOP_SHIFT;
+	if ((m->m_flags & M_VLANTAG) != 0) {
+		vtag = htons(m->m_pkthdr.ether_vtag) << TPD_VLTAG_SHIFT;
+		flags |= 1 << TPD_INS_VLTAG_SHIFT;
+	}
+
+	td = &txq->tpd_hdr[desci];
+	td->addr = htole64(txq->copy_dma + desci * ALX_TX_COPY_SZ);
+	td->len = htole32(len | vtag);
+	td->flags = flags;
+
+	tx_buf = &txq->bf_info[desci];
+	tx_buf->len = len;
+	txq->bql_posted += len;
+	txq->pidx = ALX_TX_INC(desci, sc);
+
+	bus_dmamap_sync(sc->alx_tx_copy_tag, txq->copy_map,
+	    BUS_DMASYNC_PREWRITE);
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
 	    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
 
-	ALX_MEM_W16(&sc->hw, sc->alx_tx_queue.p_reg, desci);
+	ALX_MEM_W16(&sc->hw, txq->p_reg, txq->pidx);
+
+	if (txq->watchdog_timer == 0)
+		txq->watchdog_timer = ALX_WATCHDOG_TIME;
+
+	ETHER_BPF_MTAP(sc->alx_ifp, m);
+	m_freem(m);
+	*m_head = NULL;
 
 	return (0);
 }
@@ -889,43 +2199,68 @@ alx_stop(struct alx_softc *sc)
 {
 	struct ifnet *ifp;
 	struct alx_hw *hw;
+	struct alx_tx_queue *txq;
 	struct alx_buffer *tx_buf, *rx_buf;
-	int i, error;
+	int i, q, error;
 
 	ALX_LOCK_ASSERT(sc);
 
 	hw = &sc->hw;
 	ifp = sc->alx_ifp;
 	ifp->if_drv_flags &= ~(IFF_DRV_RUNNING | IFF_DRV_OACTIVE);
+	callout_stop(&sc->alx_tick_ch);
+	ALX_FLAG_CLEAR(sc, TASK_RESET);
 
+	/* See alx_intr_process(). */
+	ALX_RX_LOCK(&sc->alx_rx_queue);
 	alx_intr_disable(sc);
+	ALX_RX_UNLOCK(&sc->alx_rx_queue);
 
 	error = alx_stop_mac(hw);
-	if (error != 0)
+	if (error != 0) {
 		device_printf(sc->alx_dev, "error stopping MAC\n");
+		ALX_FLAG_CLEAR(sc, MAC_STOPPED);
+	} else
+		ALX_FLAG_SET(sc, MAC_STOPPED);
 
-	/* XXX what else? */
-	for (i = 0; i < sc->tx_ringsz; i++) {
-		tx_buf = &sc->alx_tx_queue.bf_info[i];
-		if (tx_buf->m != NULL) {
-			bus_dmamap_sync(sc->alx_tx_buf_tag, tx_buf->dmamap,
-			    BUS_DMASYNC_POSTWRITE);
-			bus_dmamap_unload(sc->alx_tx_buf_tag, tx_buf->dmamap);
-			m_freem(tx_buf->m);
-			tx_buf->m = NULL;
-		}
-	}
-
-	for (i = 0; i < sc->rx_ringsz; i++) {
+	/*
+	 * IFF_DRV_RUNNING is clear, so once we own a queue lock nobody else
+	 * will touch that queue's buffers.
+	 */
+	ALX_RX_LOCK(&sc->alx_rx_queue);
+	for (i = 0; sc->alx_rx_queue.bf_info != NULL && i < sc->rx_ringsz;
+	    i++) {
 		rx_buf = &sc->alx_rx_queue.bf_info[i];
 		if (rx_buf->m != NULL) {
 			bus_dmamap_sync(sc->alx_rx_buf_tag, rx_buf->dmamap,
-			    BUS_DMASYNC_POSTWRITE);
+			    BUS_DMASYNC_POSTREAD);
 			bus_dmamap_unload(sc->alx_rx_buf_tag, rx_buf->dmamap);
 			m_freem(rx_buf->m);
 			rx_buf->m = NULL;
 		}
 	}
+	ALX_RX_UNLOCK(&sc->alx_rx_queue);
+
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_txq[q];
+		ALX_TX_LOCK(txq);
+		txq->watchdog_timer = 0;
+		for (i = 0; txq->bf_info != NULL && i < sc->tx_ringsz; i++) {
+			tx_buf = &txq->bf_info[i];
+			if (tx_buf->m != NULL) {
+				bus_dmamap_sync(sc->alx_tx_buf_tag,
+				    tx_buf->dmamap, BUS_DMASYNC_POSTWRITE);
+				bus_dmamap_unload(sc->alx_tx_buf_tag,
+				    tx_buf->dmamap);
+				m_freem(tx_buf->m);
+				tx_buf->m = NULL;
+			}
+		}
+		ALX_TX_UNLOCK(txq);
+	}
+#ifdef DEV_NETMAP
+	alx_netmap_stop(sc);
+#endif
 }
 
 static void
@@ -940,31 +2275,194 @@ alx_reset(struct alx_softc *sc)
 
 	alx_reset_pcie(hw);
 
-	phy_cfged = alx_phy_configed(hw);
+	phy_cfged = alx_phy_configed(hw) && !ALX_FLAG(sc, PHY_DOWN);
 	if (!phy_cfged)
 		alx_reset_phy(hw, !hw->hib_patch);
 
 	if (alx_reset_mac(hw))
 		device_printf(dev, "failed to reset MAC\n");
 
-	/* XXX what else? */
+	if (!phy_cfged) {
+		if (alx_setup_speed_duplex(hw, hw->adv_cfg, hw->flowctrl))
+			device_printf(dev, "failed to configure PHY\n");
+		ALX_FLAG_CLEAR(sc, PHY_DOWN);
+	}
+
+	alx_configure_basic(hw);
 }
 
+/*
+ * Apply flag and capability changes by rewriting the MAC control register.
+ * The rings and the link are left alone, so this is cheap enough to call
+ * on a running interface.
+ */
 static void
-alx_update_link(struct alx_softc *sc)
+alx_reconfigure(struct alx_softc *sc)
 {
+	struct ifnet *ifp;
 	struct alx_hw *hw;
-	bool link_up, prev_link_up;
-	int error;
-	uint16_t speed, prev_speed;
 
 	ALX_LOCK_ASSERT(sc);
 
+	ifp = sc->alx_ifp;
 	hw = &sc->hw;
 
-	error = alx_get_phy_link(hw, &link_up, &speed);
-	if (error != 0)
-		return;
+	if ((ifp->if_capenable & IFCAP_VLAN_HWTAGGING) != 0)
+		hw->rx_ctrl |= ALX_MAC_CTRL_VLANSTRIP;
+	else
+		hw->rx_ctrl &= ~ALX_MAC_CTRL_VLANSTRIP;
+
+	/* alx_rx_reset() rewrites RXQ0 under the RX lock. */
+	if (ALX_CAP(hw, RSS)) {
+		ALX_RX_LOCK(&sc->alx_rx_queue);
+		alx_configure_rss(hw, hw->rss_hash_type != 0);
+		ALX_RX_UNLOCK(&sc->alx_rx_queue);
+	}
+
+	/* Writes the MAC control register. */
+	alx_rxfilter(sc);
+}
+
+/*
+ * Set up the RSS key, indirection table and hash types. With "options RSS"
+ * they follow the kernel's configuration so that flows land on the same
+ * CPUs as the rest of the stack; otherwise use the driver defaults.
+ */
+static void
+alx_rss_init(struct alx_softc *sc)
+{
+	struct alx_hw *hw;
+	int i;
+#ifdef RSS
+	u_int hashconfig;
+#endif
+
+	hw = &sc->hw;
+
+#ifdef RSS
+	rss_getkey(hw->rss_key);
+	hashconfig = rss_gethashconfig();
+	hw->rss_hash_type = 0;
+	if ((hashconfig & RSS_HASHTYPE_RSS_IPV4) != 0)
+		hw->rss_hash_type |= ALX_RSS_HASH_TYPE_IPV4;
+	if ((hashconfig & RSS_HASHTYPE_RSS_TCP_IPV4) != 0)
+		hw->rss_hash_type |= ALX_RSS_HASH_TYPE_IPV4_TCP;
+	if ((hashconfig & RSS_HASHTYPE_RSS_IPV6) != 0)
+		hw->rss_hash_type |= ALX_RSS_HASH_TYPE_IPV6;
+	if ((hashconfig & RSS_HASHTYPE_RSS_TCP_IPV6) != 0)
+		hw->rss_hash_type |= ALX_RSS_HASH_TYPE_IPV6_TCP;
+#else
+	memcpy(hw->rss_key, def_rss_key, sizeof(def_rss_key));
+	hw->rss_hash_type = ALX_RSS_HASH_TYPE_ALL;
+#endif
+
+	for (i = 0; i < hw->rss_idt_size; i++) {
+#ifdef RSS
+		ALX_RSS_IDT_SET(hw, i,
+		    rss_get_indirection_to_bucket(i) % sc->nr_rxq);
+#else
+		ALX_RSS_IDT_SET(hw, i, i % sc->nr_rxq);
+#endif
+	}
+}
+
+static u_int
+alx_hash_maddr(void *arg, struct sockaddr_dl *sdl, u_int cnt __unused)
+{
+
+	alx_add_mc_addr(arg, (uint8_t *)LLADDR(sdl));
+	return (1);
+}
+
+/*
+ * Program promiscuous mode and the 64-bit multicast hash filter from the
+ * interface's flags and multicast list. Past hw.alx.mc_hash_max groups most
+ * of the hash bits are set anyway, so just accept all multicast.
+ */
+static void
+alx_rxfilter(struct alx_softc *sc)
+{
+	struct ifnet *ifp;
+	struct alx_hw *hw;
+	u_int count;
+
+	ALX_LOCK_ASSERT(sc);
+
+	ifp = sc->alx_ifp;
+	hw = &sc->hw;
+
+	hw->mc_hash[0] = hw->mc_hash[1] = 0;
+	hw->rx_ctrl &= ~(ALX_MAC_CTRL_MULTIALL_EN | ALX_MAC_CTRL_PROMISC_EN);
+
+	if ((ifp->if_flags & (IFF_PROMISC | IFF_ALLMULTI)) != 0) {
+		if ((ifp->if_flags & IFF_PROMISC) != 0)
+			hw->rx_ctrl |= ALX_MAC_CTRL_PROMISC_EN;
+		count = 0;
+	} else
+		count = if_foreach_llmaddr(ifp, alx_hash_maddr, hw);
+
+	if ((ifp->if_flags & (IFF_PROMISC | IFF_ALLMULTI)) != 0 ||
+	    count > alx_mc_hash_max) {
+		hw->rx_ctrl |= ALX_MAC_CTRL_MULTIALL_EN;
+		hw->mc_hash[0] = hw->mc_hash[1] = 0xFFFFFFFF;
+	}
+
+	ALX_MEM_W32(hw, ALX_HASH_TBL0, hw->mc_hash[0]);
+	ALX_MEM_W32(hw, ALX_HASH_TBL1, hw->mc_hash[1]);
+	ALX_MEM_W32(hw, ALX_MAC_CTRL, hw->rx_ctrl);
+}
+
+/*
+ * Power the PHY down when the interface goes down and the administrator
+ * does not want the link kept up. The next alx_init_locked() resets the
+ * PHY and renegotiates.
+ */
+static void
+alx_phy_down(struct alx_softc *sc)
+{
+	struct alx_hw *hw;
+
+	ALX_LOCK_ASSERT(sc);
+
+	hw = &sc->hw;
+
+	alx_write_phy_reg(hw, MII_BMCR, BMCR_PDOWN);
+	ALX_FLAG_SET(sc, PHY_DOWN);
+
+	if (hw->link_up) {
+		hw->link_up = false;
+		hw->link_speed = SPEED_0;
+		hw->link_duplex = 0;
+		if_link_state_change(sc->alx_ifp, LINK_STATE_DOWN);
+	}
+}
+
+static void
+alx_update_link(struct alx_softc *sc)
+{
+	bool link_up;
+	uint16_t speed;
+
+	ALX_LOCK_ASSERT(sc);
+
+	if (alx_get_phy_link(&sc->hw, &link_up, &speed) == 0)
+		alx_set_link(sc, link_up, speed);
+}
+
+/*
+ * Bring the MAC in line with the link state read from the PHY.
+ */
+static void
+alx_set_link(struct alx_softc *sc, bool link_up, uint16_t speed)
+{
+	struct alx_hw *hw;
+	bool prev_link_up;
+	int i;
+	uint16_t prev_speed;
+
+	ALX_LOCK_ASSERT(sc);
+
+	hw = &sc->hw;
 
 	if ((!link_up && !hw->link_up) ||
 	    (sc->alx_ifp->if_drv_flags & IFF_DRV_RUNNING) == 0)
@@ -983,29 +2481,77 @@ alx_update_link(struct alx_softc *sc)
 
 		alx_post_phy_link(hw, hw->link_speed, ALX_CAP(hw, AZ));
 		alx_enable_aspm(hw, ALX_CAP(hw, L0S), ALX_CAP(hw, L1));
+		/* Enables RXQ0; see alx_reconfigure(). */
+		ALX_RX_LOCK(&sc->alx_rx_queue);
 		alx_start_mac(hw);
+		ALX_RX_UNLOCK(&sc->alx_rx_queue);
 
 		if_link_state_change(sc->alx_ifp, LINK_STATE_UP);
+
+		/* Push out anything that was staged while the link was down. */
+		for (i = 0; i < sc->nr_txq; i++)
+			taskqueue_enqueue(sc->alx_tq, &sc->alx_txq[i].task);
 	} else {
 		hw->link_duplex = 0;
 		hw->link_speed = 0;
 
-		error = alx_reset_mac(hw);
-		if (error != 0) {
-			device_printf(sc->alx_dev, "failed to reset MAC\n");
-			return;
-		}
-
-		alx_intr_disable(sc);
-		/* XXX refresh rings */
-		alx_configure_basic(hw);
-		alx_configure_rss(hw, 0 /* XXX */);
 		alx_enable_aspm(hw, false, ALX_CAP(hw, L1));
 		alx_post_phy_link(hw, 0, ALX_CAP(hw, AZ));
-		alx_intr_enable(sc);
 
-		if_link_state_change(sc->alx_ifp, LINK_STATE_DOWN);
+		if_link_state_change(sc->alx_ifp, LINK_STATE_DOWN);
+
+		/*
+		 * The MAC is reset on link loss. That can't be done under the
+		 * data path's feet, so let the reset task stop the rings and
+		 * bring everything back up.
+		 */
+		ALX_FLAG_SET(sc, TASK_RESET);
+		taskqueue_enqueue(sc->alx_link_tq, &sc->alx_reset_task);
+	}
+}
+
+/*
+ * Service the TX and RX rings. The filter left interrupts disabled; they
+ * are re-enabled once all pending work is done. Returns true if the RX
+ * budget ran out and there may be more to do, in which case interrupts
+ * stay disabled.
+ */
+static bool
+alx_intr_process(struct alx_softc *sc)
+{
+	struct ifnet *ifp;
+	struct alx_tx_queue *txq;
+	bool more;
+	int i;
+
+	ifp = sc->alx_ifp;
+	more = false;
+
+	for (i = 0; i < sc->nr_txq; i++) {
+		txq = &sc->alx_txq[i];
+		ALX_TX_LOCK(txq);
+		if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0) {
+			alx_txintr(sc, txq);
+			if (!drbr_empty(ifp, txq->br))
+				alx_txq_drain(sc, txq);
+		}
+		ALX_TX_UNLOCK(txq);
+	}
+
+	/*
+	 * alx_stop() disables interrupts with the RX lock held, so checking
+	 * IFF_DRV_RUNNING under it keeps us from re-enabling them on a
+	 * stopped device.
+	 */
+	ALX_RX_LOCK(&sc->alx_rx_queue);
+	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0) {
+		more = alx_rxintr(sc, sc->alx_process_limit);
+		if (!more && (ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+			ALX_MEM_W32(&sc->hw, ALX_ISR, 0);
 	}
+	ALX_RX_UNLOCK(&sc->alx_rx_queue);
+
+	return (more);
 }
 
 static void
@@ -1019,36 +2565,124 @@ alx_int_task(void *context, int pending __unused)
 
 	sc = context;
 
-	ALX_LOCK(sc);
+	if (alx_intr_process(sc))
+		taskqueue_enqueue(sc->alx_tq, &sc->alx_int_task);
+}
 
-	/* XXX check isr? */
-	alx_rxintr(sc);
-	alx_txintr(sc);
+/*
+ * Interrupt thread handler, used when hw.alx.intr_ithread is set. Rings
+ * are processed right here; if the budget runs out the rest is left to the
+ * taskqueue so that the interrupt thread doesn't monopolize the CPU.
+ */
+static void
+alx_intr_thread(void *arg)
+{
+	struct alx_softc *sc;
 
-	ALX_UNLOCK(sc);
+	sc = arg;
+
+	if (alx_intr_process(sc))
+		taskqueue_enqueue(sc->alx_tq, &sc->alx_int_task);
 }
 
+/*
+ * Runs on its own taskqueue so that slow MDIO transactions never hold up
+ * interrupt processing. The PHY is only accessed under the MDIO lock; the
+ * control lock is held just long enough to apply the result.
+ */
 static void
 alx_link_task(void *arg, int pending __unused)
 {
 	struct alx_softc *sc;
 	struct alx_hw *hw;
+	bool link_up;
+	int error;
+	uint16_t speed;
 
 	sc = arg;
 	hw = &sc->hw;
 
-	ALX_LOCK(sc);
-
 	alx_clear_phy_intr(hw);
+	error = alx_get_phy_link(hw, &link_up, &speed);
+
+	ALX_LOCK(sc);
 
 	hw->imask |= ALX_ISR_PHY;
 	ALX_MEM_W32(hw, ALX_IMR, hw->imask);
 
-	alx_update_link(sc);
+	if (error == 0)
+		alx_set_link(sc, link_up, speed);
+
+	ALX_UNLOCK(sc);
+}
+
+/*
+ * Recover from a fatal DMA or PCIe error or a stuck TX queue: quiesce, reset
+ * the MAC and re-post the rings. The PHY is left alone, so the link stays up
+ * and recovery takes about as long as a MAC reset.
+ */
+static void
+alx_reset_task(void *arg, int pending __unused)
+{
+	struct alx_softc *sc;
+	struct ifnet *ifp;
+
+	sc = arg;
+	ifp = sc->alx_ifp;
+
+	ALX_LOCK(sc);
+	if (!ALX_FLAG_TESTANDCLEAR(sc, TASK_RESET) ||
+	    (ifp->if_drv_flags & IFF_DRV_RUNNING) == 0) {
+		ALX_UNLOCK(sc);
+		return;
+	}
 
+	/* Resets after link loss are routine. */
+	if (sc->hw.link_up)
+		device_printf(sc->alx_dev, "resetting\n");
+	ifp->if_drv_flags &= ~IFF_DRV_RUNNING;
+	ALX_FLAG_CLEAR(sc, MAC_STOPPED);
+	alx_init_locked(sc);
 	ALX_UNLOCK(sc);
 }
 
+/*
+ * Once a second: look for TX queues that have had frames outstanding for
+ * too long without any completions. Without link nothing completes, so
+ * the watchdogs are held while the link is down.
+ */
+static void
+alx_tick(void *arg)
+{
+	struct alx_softc *sc;
+	struct alx_tx_queue *txq;
+	bool hung;
+	int i;
+
+	sc = arg;
+	ALX_LOCK_ASSERT(sc);
+
+	hung = false;
+	for (i = 0; sc->hw.link_up && i < sc->nr_txq; i++) {
+		txq = &sc->alx_txq[i];
+		ALX_TX_LOCK(txq);
+		if (txq->watchdog_timer > 0 && --txq->watchdog_timer == 0) {
+			device_printf(sc->alx_dev,
+			    "watchdog timeout on TX queue %d\n", i);
+			hung = true;
+		}
+		ALX_TX_UNLOCK(txq);
+	}
+
+	if (hung) {
+		if_inc_counter(sc->alx_ifp, IFCOUNTER_OERRORS, 1);
+		ALX_FLAG_SET(sc, TASK_RESET);
+		taskqueue_enqueue(sc->alx_link_tq, &sc->alx_reset_task);
+	}
+
+	callout_reset(&sc->alx_tick_ch, hz, alx_tick, sc);
+}
+
 static int
 alx_intr_legacy(void *arg)
 {
@@ -1067,22 +2701,7 @@ alx_intr_legacy(void *arg)
 	printf("intr is 0x%x, imask is 0x%x\n", intr, hw->imask);
 #endif
 
-	/* Acknowledge and disable interrupts. */
-	ALX_MEM_W32(hw, ALX_ISR, intr | ALX_ISR_DIS);
-
-	intr &= hw->imask;
-	if (intr & ALX_ISR_PHY) {
-		hw->imask &= ~ALX_ISR_PHY;
-		ALX_MEM_W32(hw, ALX_IMR, hw->imask);
-		taskqueue_enqueue(sc->alx_tq, &sc->alx_link_task);
-	}
-
-	if (intr & (ALX_ISR_TX_Q0 | ALX_ISR_RX_Q0))
-		taskqueue_enqueue(sc->alx_tq, &sc->alx_int_task);
-
-	ALX_MEM_W32(hw, ALX_ISR, 0);
-
-	return (FILTER_HANDLED);
+	return (alx_intr_filter(sc, intr));
 }
 
 static int
@@ -1097,13 +2716,49 @@ alx_intr_msi(void *arg)
 
 	ALX_MEM_R32(hw, ALX_ISR, &intr);
 
+	return (alx_intr_filter(sc, intr));
+}
+
+/*
+ * Common part of the interrupt filters: acknowledge the interrupt, hand
+ * PHY events to the link task and ring events to either the interrupt
+ * thread or the taskqueue.
+ *
+ * Ring events leave interrupts disabled until alx_intr_process() has
+ * drained the rings, so a busy port takes one interrupt and one status
+ * read per batch rather than per frame. (The chip has a CMB address
+ * register, but no documented way to enable status write-back or its
+ * layout, so the status still comes from ALX_ISR.)
+ */
+static int
+alx_intr_filter(struct alx_softc *sc, uint32_t intr)
+{
+	struct alx_hw *hw;
+
+	hw = &sc->hw;
+
+	/* Acknowledge and disable interrupts. */
 	ALX_MEM_W32(hw, ALX_ISR, intr | ALX_ISR_DIS);
 
 	intr &= hw->imask;
+	if (intr & (ALX_ISR_FATAL | ALX_ISR_TXQ_TO)) {
+		/* Interrupts stay disabled; the reset re-enables them. */
+		ALX_FLAG_SET(sc, TASK_RESET);
+		taskqueue_enqueue(sc->alx_link_tq, &sc->alx_reset_task);
+		return (FILTER_HANDLED);
+	}
+
 	if (intr & ALX_ISR_PHY) {
 		hw->imask &= ~ALX_ISR_PHY;
 		ALX_MEM_W32(hw, ALX_IMR, hw->imask);
-		taskqueue_enqueue(sc->alx_tq, &sc->alx_link_task);
+		taskqueue_enqueue(sc->alx_link_tq, &sc->alx_link_task);
+	}
+
+	if (intr & ALX_ISR_ALL_QUEUES) {
+		if (sc->alx_intr_ithread)
+			return (FILTER_SCHEDULE_THREAD);
+		taskqueue_enqueue(sc->alx_tq, &sc->alx_int_task);
+		return (FILTER_HANDLED);
 	}
 
 	ALX_MEM_W32(hw, ALX_ISR, 0);
@@ -1111,12 +2766,52 @@ alx_intr_msi(void *arg)
 	return (FILTER_HANDLED);
 }
 
+/*
+ * Pick the CPU for the interrupt and the taskqueue thread that services the
+ * rings. "hint.alx.N.intr_cpu" overrides the choice, with -1 meaning no
+ * binding. By default ports are spread over the CPUs local to the NIC.
+ */
+static int
+alx_intr_cpu(struct alx_softc *sc)
+{
+	device_t dev;
+	cpuset_t cpus;
+	int cpu, n;
+
+	dev = sc->alx_dev;
+
+	if (resource_int_value(device_get_name(dev), device_get_unit(dev),
+	    "intr_cpu", &cpu) == 0) {
+		if (cpu < 0)
+			return (NOCPU);
+		if (cpu > mp_maxid || CPU_ABSENT(cpu)) {
+			device_printf(dev, "invalid intr_cpu %d\n", cpu);
+			return (NOCPU);
+		}
+		return (cpu);
+	}
+
+	if (mp_ncpus == 1 ||
+	    bus_get_cpus(dev, LOCAL_CPUS, sizeof(cpus), &cpus) != 0 ||
+	    CPU_EMPTY(&cpus))
+		return (NOCPU);
+
+	n = device_get_unit(dev) % CPU_COUNT(&cpus);
+	CPU_FOREACH(cpu) {
+		if (CPU_ISSET(cpu, &cpus) && n-- == 0)
+			return (cpu);
+	}
+
+	return (NOCPU);
+}
+
 static int
 alx_alloc_intr(struct alx_softc *sc)
 {
 	device_t dev;
 	driver_filter_t *filter;
 	struct alx_hw *hw;
+	cpuset_t cpus;
 	uint32_t msi_ctrl;
 	int rid, error, nmsi;
 
@@ -1143,7 +2838,9 @@ alx_alloc_intr(struct alx_softc *sc)
 	if (!ALX_FLAG(sc, USING_MSIX) && !ALX_FLAG(sc, USING_MSI))
 		ALX_MEM_W32(hw, ALX_MSI_RETRANS_TIMER, 0);
 
-	sc->nr_txq = 1;
+	/* The priority rings all share the one TX interrupt. */
+	sc->nr_txq = ALX_CAP(hw, MTQ) && alx_tx_prio != 0 ?
+	    ALX_MAX_TX_QUEUES : 1;
 	sc->nr_rxq = 1; // XXX needed?
 	sc->nr_vec = 1;
 	sc->nr_hwrxq = 1;
@@ -1155,48 +2852,103 @@ alx_alloc_intr(struct alx_softc *sc)
 		return (ENXIO);
 	}
 
-	error = bus_setup_intr(dev, sc->alx_irq, INTR_TYPE_NET | INTR_MPSAFE,
-	    filter, NULL, sc, &sc->alx_cookie);
-	if (error != 0) {
-		device_printf(dev, "failed to register interrupt handler\n");
-		return (ENXIO);
-	}
-
+	/* The filters enqueue tasks, so the taskqueues have to exist first. */
 	TASK_INIT(&sc->alx_int_task, 0, alx_int_task, sc);
 	TASK_INIT(&sc->alx_link_task, 0, alx_link_task, sc);
+	TASK_INIT(&sc->alx_reset_task, 0, alx_reset_task, sc);
 	sc->alx_tq = taskqueue_create_fast("alx_taskq", M_WAITOK,
 	    taskqueue_thread_enqueue, &sc->alx_tq);
 	if (sc->alx_tq == NULL) {
 		device_printf(dev, "could not create taskqueue\n");
 		return (ENXIO);
 	}
-	taskqueue_start_threads(&sc->alx_tq, 1, PI_NET, "%s taskq",
+	sc->alx_intr_cpu = alx_intr_cpu(sc);
+	if (sc->alx_intr_cpu != NOCPU) {
+		CPU_SETOF(sc->alx_intr_cpu, &cpus);
+		taskqueue_start_threads_cpuset(&sc->alx_tq, 1, PI_NET, &cpus,
+		    "%s taskq", device_get_nameunit(sc->alx_dev));
+	} else
+		taskqueue_start_threads(&sc->alx_tq, 1, PI_NET, "%s taskq",
+		    device_get_nameunit(sc->alx_dev));
+
+	sc->alx_link_tq = taskqueue_create_fast("alx_link_taskq", M_WAITOK,
+	    taskqueue_thread_enqueue, &sc->alx_link_tq);
+	if (sc->alx_link_tq == NULL) {
+		device_printf(dev, "could not create link taskqueue\n");
+		return (ENXIO);
+	}
+	taskqueue_start_threads(&sc->alx_link_tq, 1, PI_NET, "%s link taskq",
 	    device_get_nameunit(sc->alx_dev));
 
+	sc->alx_intr_ithread = alx_intr_ithread;
+	sc->alx_process_limit = alx_process_limit;
+	sc->alx_keep_link = alx_keep_link;
+	sc->alx_bql_max = alx_tx_bql_max;
+	sc->alx_tx_copy_thresh = imin(imax(alx_tx_copy_thresh, 0),
+	    ALX_TX_COPY_SZ);
+	if (sc->alx_process_limit <= 0)
+		sc->alx_process_limit = ALX_DEFAULT_RX_WORK;
+
+	error = bus_setup_intr(dev, sc->alx_irq, INTR_TYPE_NET | INTR_MPSAFE,
+	    filter, sc->alx_intr_ithread ? alx_intr_thread : NULL, sc,
+	    &sc->alx_cookie);
+	if (error != 0) {
+		device_printf(dev, "failed to register interrupt handler\n");
+		return (ENXIO);
+	}
+
+	if (sc->alx_intr_cpu != NOCPU &&
+	    bus_bind_intr(dev, sc->alx_irq, sc->alx_intr_cpu) != 0)
+		device_printf(dev, "could not bind interrupt to CPU %d\n",
+		    sc->alx_intr_cpu);
+
 	return (0);
 }
 
+/*
+ * Tear down the interrupt handler before draining the tasks it schedules.
+ * Safe to call more than once.
+ */
 static void
 alx_free_intr(struct alx_softc *sc)
 {
 	device_t dev;
+	int i;
 
 	dev = sc->alx_dev;
 
+	if (sc->alx_cookie != NULL) {
+		bus_teardown_intr(dev, sc->alx_irq, sc->alx_cookie);
+		sc->alx_cookie = NULL;
+	}
+
+	if (sc->alx_link_tq != NULL) {
+		taskqueue_drain(sc->alx_link_tq, &sc->alx_link_task);
+		taskqueue_drain(sc->alx_link_tq, &sc->alx_reset_task);
+		taskqueue_free(sc->alx_link_tq);
+		sc->alx_link_tq = NULL;
+	}
+
 	if (sc->alx_tq != NULL) {
 		taskqueue_drain(sc->alx_tq, &sc->alx_int_task);
-		taskqueue_drain(taskqueue_swi, &sc->alx_link_task);
+		for (i = 0; i < ALX_MAX_TX_QUEUES; i++)
+			if (sc->alx_txq[i].br != NULL)
+				taskqueue_drain(sc->alx_tq,
+				    &sc->alx_txq[i].task);
 		taskqueue_free(sc->alx_tq);
+		sc->alx_tq = NULL;
 	}
 
-	if (sc->alx_cookie != NULL)
-		bus_teardown_intr(dev, sc->alx_irq, sc->alx_cookie);
-
-	if (sc->alx_irq != NULL)
-		bus_release_resource(dev, SYS_RES_IRQ, 0, sc->alx_irq);
+	if (sc->alx_irq != NULL) {
+		bus_release_resource(dev, SYS_RES_IRQ,
+		    rman_get_rid(sc->alx_irq), sc->alx_irq);
+		sc->alx_irq = NULL;
+	}
 
-	if (ALX_FLAG(sc, USING_MSI))
+	if (ALX_FLAG(sc, USING_MSI)) {
 		pci_release_msi(dev);
+		ALX_FLAG_CLEAR(sc, USING_MSI);
+	}
 }
 
 static int
@@ -1264,7 +3016,7 @@ alx_ioctl(struct ifnet *ifp, u_long command, caddr_t data)
 {
 	struct alx_softc *sc;
 	struct ifreq *ifr;
-	int error = 0;
+	int error = 0, mask;
 
 	sc = ifp->if_softc;
 	ifr = (struct ifreq *)data;
@@ -1272,16 +3024,48 @@ alx_ioctl(struct ifnet *ifp, u_long command, caddr_t data)
 	switch (command) {
 	case SIOCSIFFLAGS:
 		ALX_LOCK(sc);
-		if ((ifp->if_flags & IFF_UP) &&
-		    !(ifp->if_flags & IFF_DRV_RUNNING)) {
-			alx_init_locked(sc);
-		} else {
-			if (!(ifp->if_flags & IFF_DRV_RUNNING))
-				alx_stop(sc);
+		if ((ifp->if_flags & IFF_UP) != 0) {
+			/* Filter changes only need the MAC control register. */
+			if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0) {
+				if (((ifp->if_flags ^ sc->alx_if_flags) &
+				    (IFF_PROMISC | IFF_ALLMULTI)) != 0)
+					alx_rxfilter(sc);
+			} else
+				alx_init_locked(sc);
+		} else if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0) {
+			alx_stop(sc);
+			if (!sc->alx_keep_link)
+				alx_phy_down(sc);
 		}
 		sc->alx_if_flags = ifp->if_flags;
 		ALX_UNLOCK(sc);
 		break;
+	case SIOCSIFCAP:
+		ALX_LOCK(sc);
+		mask = ifr->ifr_reqcap ^ ifp->if_capenable;
+		if ((mask & IFCAP_VLAN_HWTAGGING) != 0 &&
+		    (ifp->if_capabilities & IFCAP_VLAN_HWTAGGING) != 0) {
+			ifp->if_capenable ^= IFCAP_VLAN_HWTAGGING;
+			if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+				alx_reconfigure(sc);
+		}
+		/* These only change how alx_rxintr() treats the RRD. */
+		if ((mask & IFCAP_RXCSUM) != 0 &&
+		    (ifp->if_capabilities & IFCAP_RXCSUM) != 0)
+			ifp->if_capenable ^= IFCAP_RXCSUM;
+		if ((mask & IFCAP_LRO) != 0 &&
+		    (ifp->if_capabilities & IFCAP_LRO) != 0)
+			ifp->if_capenable ^= IFCAP_LRO;
+		ALX_UNLOCK(sc);
+		VLAN_CAPABILITIES(ifp);
+		break;
+	case SIOCADDMULTI:
+	case SIOCDELMULTI:
+		ALX_LOCK(sc);
+		if ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0)
+			alx_rxfilter(sc);
+		ALX_UNLOCK(sc);
+		break;
 	case SIOCGIFMEDIA:
 		error = ifmedia_ioctl(ifp, ifr, &sc->alx_media, command);
 		break;
@@ -1304,11 +3088,36 @@ alx_init(void *arg)
 	ALX_UNLOCK(sc);
 }
 
+/*
+ * The rings are set up again from index 0, but only a MAC reset is known to
+ * rewind the hardware's consumer indices; ALX_SRAM_LOAD_PTR only reloads
+ * the ring base addresses. Report whether the hardware is still at the start
+ * of every ring, in which case the reset can be skipped. The RRD write index
+ * can't be read back, but with one RFD per frame it follows the RFD consumer
+ * index.
+ */
+static bool
+alx_rings_rewound(struct alx_softc *sc)
+{
+	uint16_t cidx;
+	int i;
+
+	for (i = 0; i < sc->nr_txq; i++) {
+		ALX_MEM_R16(&sc->hw, alx_txq_regs[i].cidx, &cidx);
+		if (cidx != 0)
+			return (false);
+	}
+	ALX_MEM_R16(&sc->hw, ALX_RFD_CIDX, &cidx);
+
+	return ((cidx & ALX_RFD_CIDX_MASK) == 0);
+}
+
 static void
 alx_init_locked(struct alx_softc *sc)
 {
 	struct ifnet *ifp;
 	struct alx_hw *hw;
+	bool fast;
 
 	ALX_LOCK_ASSERT(sc);
 
@@ -1318,84 +3127,233 @@ alx_init_locked(struct alx_softc *sc)
 	if (ifp->if_drv_flags & IFF_DRV_RUNNING)
 		return;
 
-	alx_stop(sc);
+	/* The rings may be missing if a resize failed. */
+	if (sc->ring_header.desc == NULL)
+		return;
 
-	/* Reset to a known good state. */
-	alx_reset(sc);
+	/*
+	 * If the MAC was stopped cleanly last time and the PHY is still up,
+	 * the MAC keeps its configuration and only the rings need to be set
+	 * up again. Otherwise reset to a known good state.
+	 */
+	fast = ALX_FLAG(sc, MAC_STOPPED) && !ALX_FLAG(sc, PHY_DOWN);
+	alx_stop(sc);
+	if (fast && ALX_FLAG(sc, MAC_STOPPED))
+		fast = alx_rings_rewound(sc);
+	if (!fast || !ALX_FLAG(sc, MAC_STOPPED))
+		alx_reset(sc);
+	ALX_FLAG_CLEAR(sc, MAC_STOPPED);
 
 	memcpy(hw->mac_addr, IF_LLADDR(ifp), ETHER_ADDR_LEN);
 	alx_set_macaddr(hw, hw->mac_addr);
 
+	ALX_RX_LOCK(&sc->alx_rx_queue);
 	alx_init_rx_ring(sc);
+	ALX_RX_UNLOCK(&sc->alx_rx_queue);
 	alx_init_tx_ring(sc);
 
 #if 0
 	printf("rfd: 0x%lx, rrd: 0x%lx, txd: 0x%lx\n", sc->alx_rx_queue.rfd_dma,
-	    sc->alx_rx_queue.rrd_dma, sc->alx_tx_queue.tpd_dma);
+	    sc->alx_rx_queue.rrd_dma, sc->alx_txq[0].tpd_dma);
 #endif
 
 	/* Load the DMA pointers. */
 	ALX_MEM_W32(hw, ALX_SRAM9, ALX_SRAM_LOAD_PTR);
 
-	/*
-	 * XXX configure some VLAN rx strip thingy and some promiscuous mode
-	 * stuff and some multicast stuff.
-	 */
+	alx_reconfigure(sc);
 
 	ifp->if_drv_flags |= IFF_DRV_RUNNING;
 	ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
 
+	/*
+	 * The MAC is stopped, so forget the cached link state and let
+	 * alx_set_link() bring it back up. The PHY was not touched unless it
+	 * had been powered down; if the link is still up the stack sees no
+	 * state change.
+	 */
+	hw->link_up = false;
+	hw->link_speed = SPEED_0;
+	hw->link_duplex = 0;
 	alx_update_link(sc);
 
 	ALX_MEM_W32(hw, ALX_ISR, (uint32_t)~ALX_ISR_DIS);
 	alx_intr_enable(sc);
+	callout_reset(&sc->alx_tick_ch, hz, alx_tick, sc);
 }
 
-static void
-alx_start(struct ifnet *ifp)
+/*
+ * Pick the TX priority ring for a frame from its 802.1p priority: the PCP
+ * of its VLAN tag if it has one, or else the class selector (top three
+ * bits) of the DSCP. Headers that aren't in the first mbuf are not looked
+ * for; such frames get priority 0.
+ */
+static int
+alx_tx_classify(struct alx_softc *sc, struct mbuf *m)
 {
-	struct alx_softc *sc = ifp->if_softc;
-
-	if (!(ifp->if_drv_flags & IFF_DRV_RUNNING))
-		return;
+	struct ether_vlan_header *evh;
+	struct ip *ip;
+	struct ip6_hdr *ip6;
+	int prio;
+
+	if ((m->m_flags & M_VLANTAG) != 0)
+		return (sc->alx_prio_map[EVL_PRIOFTAG(m->m_pkthdr.ether_vtag)]);
+
+	if (m->m_len < ETHER_HDR_LEN)
+		return (sc->alx_prio_map[0]);
+
+	prio = 0;
+	evh = mtod(m, struct ether_vlan_header *);
+	switch (ntohs(evh->evl_encap_proto)) {
+	case ETHERTYPE_VLAN:
+		if (m->m_len >= ETHER_HDR_LEN + ETHER_VLAN_ENCAP_LEN)
+			prio = EVL_PRIOFTAG(ntohs(evh->evl_tag));
+		break;
+	case ETHERTYPE_IP:
+		if (m->m_len >= ETHER_HDR_LEN + sizeof(struct ip)) {
+			ip = (struct ip *)(mtod(m, char *) + ETHER_HDR_LEN);
+			prio = ip->ip_tos >> 5;
+		}
+		break;
+	case ETHERTYPE_IPV6:
+		if (m->m_len >= ETHER_HDR_LEN + sizeof(struct ip6_hdr)) {
+			ip6 = (struct ip6_hdr *)(mtod(m, char *) +
+			    ETHER_HDR_LEN);
+			prio = (ntohl(ip6->ip6_flow) >> 25) & 0x7;
+		}
+		break;
+	}
 
-	ALX_LOCK(sc);
-	alx_start_locked(ifp);
-	ALX_UNLOCK(sc);
+	return (sc->alx_prio_map[prio]);
 }
 
 /*
- * Transmit all of the frames in our send queue.
+ * Pick a TX queue for the frame and stage it on that queue's buf_ring. If
+ * the queue lock is free, drain the ring here; otherwise whoever holds the
+ * lock, or the queue's task, picks the frame up.
  */
-static void
-alx_start_locked(struct ifnet *ifp)
+static int
+alx_transmit(struct ifnet *ifp, struct mbuf *m)
 {
 	struct alx_softc *sc;
-	struct mbuf *m_head;
+	struct alx_tx_queue *txq;
+	int error, i, len;
 
 	sc = ifp->if_softc;
-	ALX_LOCK_ASSERT(sc);
 
-	if ((ifp->if_drv_flags & (IFF_DRV_RUNNING | IFF_DRV_OACTIVE)) !=
-	    IFF_DRV_RUNNING || !sc->hw.link_up)
+	/*
+	 * The rings are priority classes, not flow queues; the flow hash
+	 * says nothing about which one a frame belongs on.
+	 */
+	i = sc->nr_txq > 1 ? alx_tx_classify(sc, m) : 0;
+	txq = &sc->alx_txq[i];
+
+	/*
+	 * The byte queue limit applies to the descriptor ring only. The
+	 * buf_ring gets a fixed, generous cap so that a stalled queue can't
+	 * pin megabytes of mbufs, without pushing back on TCP under load.
+	 */
+	if (atomic_load_int(&txq->br_bytes) >= ALX_TX_BR_BYTES) {
+		m_freem(m);
+		if_inc_counter(ifp, IFCOUNTER_OQDROPS, 1);
+		return (ENOBUFS);
+	}
+
+	/* Count the frame first; alx_txq_drain() may take it at once. */
+	len = m->m_pkthdr.len;
+	atomic_add_int(&txq->br_bytes, len);
+	error = drbr_enqueue(ifp, txq->br, m);
+	if (error != 0) {
+		atomic_subtract_int(&txq->br_bytes, len);
+		return (error);
+	}
+
+	if (ALX_TX_TRYLOCK(txq)) {
+		alx_txq_drain(sc, txq);
+		ALX_TX_UNLOCK(txq);
+	} else
+		taskqueue_enqueue(sc->alx_tq, &txq->task);
+
+	return (0);
+}
+
+/*
+ * Move as many frames as fit from the queue's buf_ring to its descriptor
+ * ring, stopping once the queue's byte limit is reached.
+ */
+static void
+alx_txq_drain(struct alx_softc *sc, struct alx_tx_queue *txq)
+{
+	struct ifnet *ifp;
+	struct mbuf *m;
+	int len;
+
+	ifp = sc->alx_ifp;
+	ALX_TX_LOCK_ASSERT(txq);
+
+	if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0 || !sc->hw.link_up)
 		return;
 
-	while (!IFQ_DRV_IS_EMPTY(&ifp->if_snd)) {
-		IFQ_DRV_DEQUEUE(&ifp->if_snd, m_head);
-		if (m_head == NULL)
+	txq->bql_stopped = false;
+	while ((m = drbr_peek(ifp, txq->br)) != NULL) {
+		if (sc->alx_bql_max > 0 &&
+		    ALX_BQL_INFLIGHT(txq) >= txq->bql_limit) {
+			/* alx_intr_process() calls us again as bytes complete. */
+			drbr_putback(ifp, txq->br, m);
+			txq->bql_stopped = true;
 			break;
-
-		if (alx_xmit(sc, &m_head)) {
-			if (m_head != NULL)
-				IFQ_DRV_PREPEND(&ifp->if_snd, m_head);
+		}
+		len = m->m_pkthdr.len;
+		if (alx_xmit(sc, txq, &m) != 0) {
+			if (m == NULL) {
+				drbr_advance(ifp, txq->br);
+				atomic_subtract_int(&txq->br_bytes, len);
+			} else
+				drbr_putback(ifp, txq->br, m);
 			break;
 		}
+		drbr_advance(ifp, txq->br);
+		atomic_subtract_int(&txq->br_bytes, len);
 
 		/* Let BPF listeners know about this frame. */
-		ETHER_BPF_MTAP(ifp, m_head);
+		if (m != NULL)
+			ETHER_BPF_MTAP(ifp, m);
 	}
+}
+
+static void
+alx_txq_task(void *arg, int pending __unused)
+{
+	struct alx_tx_queue *txq;
+
+	txq = arg;
+
+	ALX_TX_LOCK(txq);
+	if (!drbr_empty(txq->sc->alx_ifp, txq->br))
+		alx_txq_drain(txq->sc, txq);
+	ALX_TX_UNLOCK(txq);
+}
+
+static void
+alx_qflush(struct ifnet *ifp)
+{
+	struct alx_softc *sc;
+	struct alx_tx_queue *txq;
+	struct mbuf *m;
+	int i;
+
+	sc = ifp->if_softc;
 
-	/* XXX start wdog */
+	for (i = 0; i < sc->nr_txq; i++) {
+		txq = &sc->alx_txq[i];
+		ALX_TX_LOCK(txq);
+		/* Not drbr_flush(); br_bytes must stay in step with br. */
+		while ((m = drbr_dequeue(ifp, txq->br)) != NULL) {
+			atomic_subtract_int(&txq->br_bytes, m->m_pkthdr.len);
+			m_freem(m);
+		}
+		ALX_TX_UNLOCK(txq);
+	}
+	if_qflush(ifp);
 }
 
 static int
@@ -1427,20 +3385,29 @@ alx_attach(device_t dev)
 	struct alx_hw *hw;
 	struct ifnet *ifp;
 	bool phy_cfged;
-	int error, rid;
+	int error, i, rid;
 
 	sc = device_get_softc(dev);
 	sc->alx_dev = dev;
 
 	mtx_init(&sc->alx_mtx, device_get_nameunit(dev), MTX_NETWORK_LOCK,
 	    MTX_DEF);
+	callout_init_mtx(&sc->alx_tick_ch, &sc->alx_mtx, 0);
+	mtx_init(&sc->alx_rx_queue.mtx, device_get_nameunit(dev), "alx rxq",
+	    MTX_DEF);
+	mtx_init(&sc->hw.mdio_lock, device_get_nameunit(dev), "alx mdio",
+	    MTX_DEF);
+	for (i = 0; i < ALX_MAX_TX_QUEUES; i++)
+		mtx_init(&sc->alx_txq[i].mtx, device_get_nameunit(dev),
+		    "alx txq", MTX_DEF);
 
 	rid = PCIR_BAR(0);
 	sc->alx_res = bus_alloc_resource_any(dev, SYS_RES_MEMORY, &rid,
 	    RF_ACTIVE);
 	if (sc->alx_res == NULL) {
 		device_printf(dev, "cannot allocate memory resources\n");
-		return (ENXIO);
+		error = ENXIO;
+		goto fail;
 	}
 
 	hw = &sc->hw;
@@ -1502,6 +3469,10 @@ alx_attach(device_t dev)
 	error = alx_alloc_intr(sc);
 	if (error != 0)
 		goto fail;
+	alx_rss_init(sc);
+	alx_srss_alloc(sc);
+	for (i = 0; i < nitems(sc->alx_prio_map); i++)
+		sc->alx_prio_map[i] = i * sc->nr_txq / nitems(sc->alx_prio_map);
 
 	if (!alx_get_phy_info(hw)) {
 		device_printf(dev, "failed to identify PHY\n");
@@ -1516,6 +3487,14 @@ alx_attach(device_t dev)
 		goto fail;
 	}
 
+	for (i = 0; i < sc->nr_txq; i++) {
+		sc->alx_txq[i].sc = sc;
+		sc->alx_txq[i].br = buf_ring_alloc(ALX_TX_BR_SIZE, M_DEVBUF,
+		    M_WAITOK, &sc->alx_txq[i].mtx);
+		TASK_INIT(&sc->alx_txq[i].task, 0, alx_txq_task,
+		    &sc->alx_txq[i]);
+	}
+
 	sc->alx_ifp = if_alloc(IFT_ETHER);
 	if (sc->alx_ifp == NULL) {
 		device_printf(dev, "failed to allocate an ifnet\n");
@@ -1527,9 +3506,18 @@ alx_attach(device_t dev)
 	ifp->if_softc = sc;
 	if_initname(ifp, device_get_name(dev), device_get_unit(dev));
 	ifp->if_flags = IFF_BROADCAST | IFF_SIMPLEX | IFF_MULTICAST; /* XXX */
-	ifp->if_capabilities = 0; //IFCAP_HWCSUM; /* XXX others? */
+	ifp->if_capabilities = IFCAP_VLAN_MTU | IFCAP_VLAN_HWTAGGING |
+	    IFCAP_RXCSUM;
+	if (tcp_lro_init_args(&sc->alx_rx_queue.lro, ifp, TCP_LRO_ENTRIES,
+	    sc->rx_ringsz) == 0)
+		ifp->if_capabilities |= IFCAP_LRO;
+	else
+		device_printf(dev, "could not initialize LRO\n");
+	/* XXX IFCAP_TXCSUM, TSO and others? */
+	ifp->if_capenable = ifp->if_capabilities;
 	ifp->if_ioctl = alx_ioctl;
-	ifp->if_start = alx_start;
+	ifp->if_transmit = alx_transmit;
+	ifp->if_qflush = alx_qflush;
 	ifp->if_init = alx_init;
 
 	ether_ifattach(ifp, hw->mac_addr);
@@ -1548,12 +3536,18 @@ alx_attach(device_t dev)
 	}
 	ifmedia_set(&sc->alx_media, IFM_ETHER | IFM_AUTO);
 
+	alx_sysctl_attach(sc);
+
 	hw->mtu = sc->alx_ifp->if_mtu;
 	//sc->rxbuf_size = MCLBYTES;
 	sc->rxbuf_size = ALIGN(ALX_RAW_MTU(hw->mtu));
 #if 0
 	printf("rxbuf size is %d\n", sc->rxbuf_size);
 #endif
+
+#ifdef DEV_NETMAP
+	alx_netmap_attach(sc);
+#endif
 fail:
 	if (error != 0)
 		alx_detach(dev);
@@ -1566,31 +3560,60 @@ alx_detach(device_t dev)
 {
 	struct alx_softc *sc;
 	struct alx_hw *hw;
+	int i;
 
 	sc = device_get_softc(dev);
 	hw = &sc->hw;
 
-	/* Restore permanent mac address. */
-	alx_set_macaddr(hw, hw->perm_addr);
+	/*
+	 * Detach from the stack first so that no new requests come in, then
+	 * quiesce the hardware before the interrupt and DMA resources go away.
+	 */
+	if (sc->alx_ifp != NULL) {
+		ether_ifdetach(sc->alx_ifp);
+		ALX_LOCK(sc);
+		alx_stop(sc);
+		ALX_UNLOCK(sc);
+		callout_drain(&sc->alx_tick_ch);
+		ifmedia_removeall(&sc->alx_media);
+	}
+
+	alx_free_intr(sc);
+	alx_srss_free(sc);
+	if (sc->alx_rx_queue.lro.ifp != NULL) {
+		tcp_lro_free(&sc->alx_rx_queue.lro);
+		sc->alx_rx_queue.lro.ifp = NULL;
+	}
+	alx_dma_free(sc);
 
-	/* XXX Free DMA */
-	free(sc->alx_tx_queue.bf_info, M_DEVBUF);
-	free(sc->alx_rx_queue.bf_info, M_DEVBUF);
+	for (i = 0; i < ALX_MAX_TX_QUEUES; i++)
+		if (sc->alx_txq[i].br != NULL) {
+			buf_ring_free(sc->alx_txq[i].br, M_DEVBUF);
+			sc->alx_txq[i].br = NULL;
+		}
 
 	if (sc->alx_ifp != NULL) {
-		ether_ifdetach(sc->alx_ifp);
+#ifdef DEV_NETMAP
+		netmap_detach(sc->alx_ifp);
+#endif
 		if_free(sc->alx_ifp);
 		sc->alx_ifp = NULL;
 	}
 
-	alx_free_intr(sc);
-
-	if (sc->alx_res != NULL)
+	if (sc->alx_res != NULL) {
+		/* Restore permanent mac address. */
+		alx_set_macaddr(hw, hw->perm_addr);
 		bus_release_resource(dev, SYS_RES_MEMORY, PCIR_BAR(0),
 		    sc->alx_res);
+		sc->alx_res = NULL;
+	}
 
 	bus_generic_detach(dev);
 
+	for (i = 0; i < ALX_MAX_TX_QUEUES; i++)
+		mtx_destroy(&sc->alx_txq[i].mtx);
+	mtx_destroy(&sc->hw.mdio_lock);
+	mtx_destroy(&sc->alx_rx_queue.mtx);
 	mtx_destroy(&sc->alx_mtx);
 
 	return (0);
@@ -1614,6 +3637,8 @@ alx_suspend(device_t dev)
 
 	ALX_LOCK(sc);
 	alx_stop(sc);
+	/* The MAC may lose its configuration while suspended. */
+	ALX_FLAG_CLEAR(sc, MAC_STOPPED);
 	alx_clear_phy_intr(hw);
 	ALX_UNLOCK(sc);
 
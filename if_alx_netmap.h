@@ -0,0 +1,391 @@
+#ifndef __IF_ALX_NETMAP_H__
+#define __IF_ALX_NETMAP_H__
+
+/*
+ * Native netmap support. Netmap slots map one-to-one onto the TPDs of each
+ * TX queue and onto the RFDs of the RX queue; completed frames are picked up
+ * from the RRD ring as in alx_rxintr().
+ *
+ * This file is included by if_alx.c when the driver is built with
+ * DEV_NETMAP.
+ */
+
+#include <net/netmap.h>
+#include <sys/selinfo.h>
+#include <dev/netmap/netmap_kern.h>
+
+/*
+ * Switch the interface in and out of netmap mode. The rings are set up
+ * again by alx_init_locked(), which calls alx_netmap_init_*() below.
+ */
+static int
+alx_netmap_reg(struct netmap_adapter *na, int onoff)
+{
+	struct ifnet *ifp;
+	struct alx_softc *sc;
+
+	ifp = na->ifp;
+	sc = ifp->if_softc;
+
+	ALX_LOCK(sc);
+	alx_stop(sc);
+	if (onoff)
+		nm_set_native_flags(na);
+	else
+		nm_clear_native_flags(na);
+	alx_init_locked(sc);
+	ALX_UNLOCK(sc);
+
+	return ((ifp->if_drv_flags & IFF_DRV_RUNNING) != 0 ? 0 : 1);
+}
+
+/*
+ * Post the frames userspace queued between nr_hwcur and rhead, then report
+ * what the hardware has finished sending.
+ */
+static int
+alx_netmap_txsync(struct netmap_kring *kring, int flags)
+{
+	struct netmap_adapter *na;
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+	struct ifnet *ifp;
+	struct alx_softc *sc;
+	struct alx_tx_queue *txq;
+	struct alx_buffer *tx_buf;
+	struct tpd_desc *td;
+	uint64_t paddr;
+	void *addr;
+	u_int nm_i, nic_i, len;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const head = kring->rhead;
+	uint16_t cidx;
+
+	na = kring->na;
+	ring = kring->ring;
+	ifp = na->ifp;
+	sc = ifp->if_softc;
+	txq = &sc->alx_txq[kring->ring_id];
+
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
+	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
+
+	nm_i = kring->nr_hwcur;
+	if (nm_i != head) {
+		nic_i = netmap_idx_k2n(kring, nm_i);
+		while (nm_i != head) {
+			slot = &ring->slot[nm_i];
+			len = slot->len;
+			addr = PNMB(na, slot, &paddr);
+			tx_buf = &txq->bf_info[nic_i];
+			td = &txq->tpd_hdr[nic_i];
+
+			NM_CHECK_ADDR_LEN(na, addr, len);
+
+			if ((slot->flags & NS_BUF_CHANGED) != 0)
+				netmap_reload_map(na, sc->alx_tx_buf_tag,
+				    tx_buf->dmamap, addr);
+			slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
+
+			td->addr = htole64(paddr);
+			td->len = htole32(len);
+			td->flags = (slot->flags & NS_MOREFRAG) != 0 ? 0 :
+			    1 << TPD_EOP_SHIFT;
+
+			bus_dmamap_sync(sc->alx_tx_buf_tag, tx_buf->dmamap,
+			    BUS_DMASYNC_PREWRITE);
+
+			nm_i = nm_next(nm_i, lim);
+			nic_i = nm_next(nic_i, lim);
+		}
+		kring->nr_hwcur = head;
+
+		bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
+		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+
+		txq->pidx = nic_i;
+		ALX_MEM_W16(&sc->hw, txq->p_reg, nic_i);
+	}
+
+	/* Reclaim completed slots. */
+	if ((flags & NAF_FORCE_RECLAIM) != 0 || nm_kr_txempty(kring)) {
+		ALX_MEM_R16(&sc->hw, txq->c_reg, &cidx);
+		nic_i = cidx;
+		if (nic_i >= kring->nkr_num_slots) {
+			nm_prerr("TPD index %u out of range", nic_i);
+			nic_i -= kring->nkr_num_slots;
+		}
+		txq->cidx = nic_i;
+		kring->nr_hwtail = nm_prev(netmap_idx_n2k(kring, nic_i), lim);
+	}
+
+	return (0);
+}
+
+/*
+ * Report frames the hardware has written back, then hand the slots that
+ * userspace has released back to the hardware.
+ */
+static int
+alx_netmap_rxsync(struct netmap_kring *kring, int flags)
+{
+	struct netmap_adapter *na;
+	struct netmap_ring *ring;
+	struct netmap_slot *slot;
+	struct ifnet *ifp;
+	struct alx_softc *sc;
+	struct alx_rx_queue *rxq;
+	struct alx_buffer *rx_buf;
+	struct rrd_desc *rrd;
+	uint64_t paddr;
+	void *addr;
+	u_int nm_i, nic_i, rrd_i, si, nor, stop, skip, resyncs;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const head = kring->rhead;
+	int force_update;
+
+	na = kring->na;
+	ring = kring->ring;
+	ifp = na->ifp;
+	sc = ifp->if_softc;
+	rxq = &sc->alx_rx_queue;
+	force_update = (flags & NAF_FORCE_READ) != 0 ||
+	    (kring->nr_kflags & NKR_PENDINTR) != 0;
+
+	if (head > lim)
+		return (netmap_ring_reinit(kring));
+
+	bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
+	    BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
+
+	/* Import newly received frames. */
+	if (netmap_no_pendintr || force_update) {
+		nic_i = rxq->cidx;
+		nm_i = netmap_idx_n2k(kring, nic_i);
+		rrd_i = rxq->rrd_cidx;
+		/* The hardware only owns the slots before nr_hwcur - 1. */
+		stop = nm_prev(kring->nr_hwcur, lim);
+		resyncs = 0;
+		while (nm_i != stop) {
+			rrd = &rxq->rrd_hdr[rrd_i];
+			if ((rrd->word3 & (1 << RRD_UPDATED_SHIFT)) == 0)
+				break;
+
+			si = FIELD_GETX(rrd->word0, RRD_SI);
+			nor = FIELD_GETX(rrd->word0, RRD_NOR);
+			if (si != nic_i || nor != 1) {
+				/*
+				 * Out of step; as in alx_rxintr(), drop the
+				 * frame and resynchronise on the hardware's
+				 * index, handing the skipped slots up empty.
+				 * An index outside the slots the hardware
+				 * owns can't be trusted, so reset instead.
+				 */
+				skip = (si + nor + sc->rx_ringsz - nic_i) %
+				    sc->rx_ringsz;
+				if (si >= sc->rx_ringsz || nor == 0 ||
+				    nor > sc->rx_ringsz ||
+				    skip > (stop + kring->nkr_num_slots - nm_i) %
+				    kring->nkr_num_slots ||
+				    ++resyncs > ALX_RX_RESYNC_MAX) {
+					nm_prerr("RX ring out of sync, resetting");
+					ALX_FLAG_SET(sc, TASK_RESET);
+					taskqueue_enqueue(sc->alx_link_tq,
+					    &sc->alx_reset_task);
+					break;
+				}
+				rxq->resyncs++;
+				rrd->word3 &= ~(1 << RRD_UPDATED_SHIFT);
+				if (++rrd_i == sc->rx_ringsz)
+					rrd_i = 0;
+				while (skip-- > 0) {
+					ring->slot[nm_i].len = 0;
+					ring->slot[nm_i].flags = 0;
+					nm_i = nm_next(nm_i, lim);
+					nic_i = nm_next(nic_i, lim);
+				}
+				continue;
+			}
+
+			rrd->word3 &= ~(1 << RRD_UPDATED_SHIFT);
+			if (++rrd_i == sc->rx_ringsz)
+				rrd_i = 0;
+			rx_buf = &rxq->bf_info[nic_i];
+			ring->slot[nm_i].len =
+			    FIELD_GETX(rrd->word3, RRD_PKTLEN) - ETHER_CRC_LEN;
+			ring->slot[nm_i].flags = 0;
+			bus_dmamap_sync(sc->alx_rx_buf_tag, rx_buf->dmamap,
+			    BUS_DMASYNC_POSTREAD);
+			nm_i = nm_next(nm_i, lim);
+			nic_i = nm_next(nic_i, lim);
+		}
+		if (nic_i != rxq->cidx) {
+			rxq->cidx = nic_i;
+			kring->nr_hwtail = nm_i;
+		}
+		rxq->rrd_cidx = rrd_i;
+		kring->nr_kflags &= ~NKR_PENDINTR;
+	}
+
+	/* Give released slots back to the hardware. */
+	nm_i = kring->nr_hwcur;
+	if (nm_i != head) {
+		nic_i = netmap_idx_k2n(kring, nm_i);
+		while (nm_i != head) {
+			slot = &ring->slot[nm_i];
+			addr = PNMB(na, slot, &paddr);
+			rx_buf = &rxq->bf_info[nic_i];
+
+			if (addr == NETMAP_BUF_BASE(na))
+				return (netmap_ring_reinit(kring));
+
+			if ((slot->flags & NS_BUF_CHANGED) != 0) {
+				netmap_reload_map(na, sc->alx_rx_buf_tag,
+				    rx_buf->dmamap, addr);
+				slot->flags &= ~NS_BUF_CHANGED;
+			}
+			rxq->rfd_hdr[nic_i].addr = htole64(paddr);
+			bus_dmamap_sync(sc->alx_rx_buf_tag, rx_buf->dmamap,
+			    BUS_DMASYNC_PREREAD);
+
+			nm_i = nm_next(nm_i, lim);
+			nic_i = nm_next(nic_i, lim);
+		}
+		kring->nr_hwcur = head;
+
+		bus_dmamap_sync(sc->ring_header.tag, sc->ring_header.dma,
+		    BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+
+		/* The slot before head stays with us; see alx_init_rx_ring(). */
+		rxq->pidx = nm_prev(nic_i, lim);
+		ALX_MEM_W16(&sc->hw, ALX_RFD_PIDX, rxq->pidx);
+	}
+
+	return (0);
+}
+
+/*
+ * Point every RFD at a netmap buffer. Returns false if the RX ring is not in
+ * netmap mode, in which case the caller fills it with mbufs as usual.
+ */
+static bool
+alx_netmap_init_rx(struct alx_softc *sc)
+{
+	struct netmap_adapter *na;
+	struct netmap_slot *slot;
+	struct alx_buffer *rx_buf;
+	uint64_t paddr;
+	void *addr;
+	int i, si;
+
+	na = NA(sc->alx_ifp);
+	slot = netmap_reset(na, NR_RX, 0, 0);
+	if (slot == NULL)
+		return (false);
+
+	for (i = 0; i < sc->rx_ringsz; i++) {
+		si = netmap_idx_n2k(na->rx_rings[0], i);
+		addr = PNMB(na, slot + si, &paddr);
+		rx_buf = &sc->alx_rx_queue.bf_info[i];
+		netmap_load_map(na, sc->alx_rx_buf_tag, rx_buf->dmamap, addr);
+		sc->alx_rx_queue.rfd_hdr[i].addr = htole64(paddr);
+	}
+
+	return (true);
+}
+
+static void
+alx_netmap_init_tx(struct alx_softc *sc, struct alx_tx_queue *txq)
+{
+	struct netmap_adapter *na;
+	struct netmap_slot *slot;
+	uint64_t paddr;
+	void *addr;
+	int i, si;
+
+	na = NA(sc->alx_ifp);
+	slot = netmap_reset(na, NR_TX, txq->qidx, 0);
+	if (slot == NULL)
+		return;
+
+	for (i = 0; i < sc->tx_ringsz; i++) {
+		si = netmap_idx_n2k(na->tx_rings[txq->qidx], i);
+		addr = PNMB(na, slot + si, &paddr);
+		netmap_load_map(na, sc->alx_tx_buf_tag,
+		    txq->bf_info[i].dmamap, addr);
+	}
+}
+
+/*
+ * In netmap mode the DMA maps hold netmap buffers rather than mbufs. Unload
+ * them; called by alx_stop() before the rings are refilled or the maps are
+ * destroyed.
+ */
+static void
+alx_netmap_stop(struct alx_softc *sc)
+{
+	struct netmap_adapter *na;
+	struct alx_tx_queue *txq;
+	int i, q;
+
+	na = NA(sc->alx_ifp);
+	if (!nm_native_on(na))
+		return;
+
+	ALX_RX_LOCK(&sc->alx_rx_queue);
+	for (i = 0; sc->alx_rx_queue.bf_info != NULL && i < sc->rx_ringsz;
+	    i++)
+		netmap_unload_map(na, sc->alx_rx_buf_tag,
+		    sc->alx_rx_queue.bf_info[i].dmamap);
+	ALX_RX_UNLOCK(&sc->alx_rx_queue);
+
+	for (q = 0; q < sc->nr_txq; q++) {
+		txq = &sc->alx_txq[q];
+		ALX_TX_LOCK(txq);
+		for (i = 0; txq->bf_info != NULL && i < sc->tx_ringsz; i++)
+			netmap_unload_map(na, sc->alx_tx_buf_tag,
+			    txq->bf_info[i].dmamap);
+		ALX_TX_UNLOCK(txq);
+	}
+}
+
+/*
+ * Report the current ring sizes, which the ring size sysctls may have
+ * changed since attach.
+ */
+static int
+alx_netmap_config(struct netmap_adapter *na, struct nm_config_info *info)
+{
+	struct alx_softc *sc;
+
+	sc = na->ifp->if_softc;
+	info->num_tx_rings = sc->nr_txq;
+	info->num_rx_rings = 1;
+	info->num_tx_descs = sc->tx_ringsz;
+	info->num_rx_descs = sc->rx_ringsz;
+	info->rx_buf_maxsize = sc->rxbuf_size;
+
+	return (0);
+}
+
+static void
+alx_netmap_attach(struct alx_softc *sc)
+{
+	struct netmap_adapter na;
+
+	bzero(&na, sizeof(na));
+	na.ifp = sc->alx_ifp;
+	na.na_flags = NAF_BDG_MAYSLEEP;
+	na.num_tx_desc = sc->tx_ringsz;
+	na.num_rx_desc = sc->rx_ringsz;
+	na.rx_buf_maxsize = sc->rxbuf_size;
+	na.nm_txsync = alx_netmap_txsync;
+	na.nm_rxsync = alx_netmap_rxsync;
+	na.nm_register = alx_netmap_reg;
+	na.nm_config = alx_netmap_config;
+	na.num_tx_rings = sc->nr_txq;
+	na.num_rx_rings = 1;
+	netmap_attach(&na);
+}
+
+#endif /* __IF_ALX_NETMAP_H__ */
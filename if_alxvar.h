@@ -17,28 +17,74 @@
 #ifndef _IF_ALXVAR_H_
 #define	_IF_ALXVAR_H_
 
-#define ALX_WATCHDOG_TIME   (5 * HZ)
+/* seconds a TX queue may go without completions before it is reset */
+#define ALX_WATCHDOG_TIME	5
+
+/*
+ * Default and permissible ring sizes. The RRD start index and the RRD ring
+ * size register are both 12 bits wide, so that bounds every ring.
+ */
+#define	ALX_DEF_TX_RING_SZ	256
+#define	ALX_DEF_RX_RING_SZ	512
+#define	ALX_MIN_RING_SZ		64
+#define	ALX_MAX_RING_SZ		ALX_RRD_RING_SZ_MASK
+
+/*
+ * Size of the software staging ring in front of each TX queue, and the
+ * most bytes alx_transmit() lets it hold.
+ */
+#define	ALX_TX_BR_SIZE		4096
+#define	ALX_TX_BR_BYTES		(256 * 1024)
+
+/* arg2 values for the ring size sysctl handler */
+#define	ALX_RING_TX		0
+#define	ALX_RING_RX		1
+
+/*
+ * Descriptor ring placement. The chip takes a single high address for all
+ * TX rings and another for the RX rings, so the rings must share the upper
+ * 32 bits of their bus addresses.
+ */
+#define	ALX_RING_ALIGN		8
+#if BUS_SPACE_MAXADDR > 0xFFFFFFFF
+#define	ALX_RING_BOUNDARY	((bus_addr_t)1 << 32)
+#else
+#define	ALX_RING_BOUNDARY	0
+#endif
 
 /*
  * alx_ring_header is a single, contiguous block of memory space
- * used by the three descriptor rings (tpd, rfd, rrd)
+ * used by the descriptor rings (the tpd ring of every tx queue, rrd, rfd)
  */
 struct alx_ring_header {
+	bus_dma_tag_t	 tag;
 	/* virt addr */
 	void		*desc;
-	/* phy addr */
+	/* dma map */
 	bus_dmamap_t	 dma;
+	/* phy addr */
+	bus_addr_t	 busaddr;
 	uint32_t	 size;
 };
 
 struct alx_buffer {
 	struct mbuf	*m;
 	bus_dmamap_t	 dmamap;
+	/* TX: bytes credited back to the byte queue limit on reclaim */
+	u_int		 len;
 };
 #define ALX_BUF_TX_FIRSTFRAG	0x1
 
+/*
+ * The queue structures are split into cache lines: fields that are only
+ * written at init time, the producer side and the consumer side. That
+ * keeps the side that refills or posts descriptors from invalidating the
+ * line of the side that reclaims them.
+ */
+
 /* rx queue */
 struct alx_rx_queue {
+	/* read-mostly */
 	struct rrd_desc *rrd_hdr;
 	bus_addr_t rrd_dma;
 
@@ -49,11 +95,6 @@ struct alx_rx_queue {
 
 	/* number of ring elements */
 	uint16_t count;
-	/* rfd producer index */
-	uint16_t pidx;
-	/* rfd consumer index */
-	uint16_t cidx;
-	uint16_t rrd_cidx;
 	/* register saving producer index */
 	uint16_t p_reg;
 	/* register saving consumer index */
@@ -61,33 +102,117 @@ struct alx_rx_queue {
 	/* queue index */
 	uint16_t qidx;
 	unsigned long flag;
-};
+
+	/* protects the ring indices and buffers */
+	struct mtx mtx __aligned(CACHE_LINE_SIZE);
+
+	/* producer side: rfd refill */
+	/* rfd producer index */
+	uint16_t pidx __aligned(CACHE_LINE_SIZE);
+
+	/* consumer side: rrd processing */
+	/* rfd consumer index */
+	uint16_t cidx __aligned(CACHE_LINE_SIZE);
+	uint16_t rrd_cidx;
+	/* RRDs that did not match the expected RFD */
+	uint64_t resyncs;
+	/* times the RX queue had to be stopped and resynchronised */
+	uint64_t resets;
+	/* frames dropped or consumed by the pfil hook */
+	uint64_t pfil_drops;
+	/* large receive offload state, used only by alx_rxintr() */
+	struct lro_ctrl lro;
+} __aligned(CACHE_LINE_SIZE);
 #define ALX_RQ_USING		1
 #define ALX_RX_ALLOC_THRESH	32
+/* mismatched RRDs tolerated per pass before the RX queue is reset */
+#define ALX_RX_RESYNC_MAX	4
 
 /* tx queue */
 struct alx_tx_queue {
+	/* read-mostly */
+	struct alx_softc *sc;
+	struct buf_ring *br;
+	/* drains br when the producer couldn't get the queue lock */
+	struct task task;
+
 	struct tpd_desc *tpd_hdr;
 	bus_addr_t tpd_dma;
 
 	struct alx_buffer *bf_info;
 
+	/* pre-mapped copy buffers for small frames, ALX_TX_COPY_SZ per TPD */
+	char *copy_buf;
+	bus_dmamap_t copy_map;
+	bus_addr_t copy_dma;
+
 	/* number of ring elements  */
 	uint16_t count;
-	/* producer index */
-	uint16_t pidx;
-	/* consumer index */
-	atomic_t cidx;
 	/* register saving producer index */
 	uint16_t p_reg;
 	/* register saving consumer index */
 	uint16_t c_reg;
 	/* queue index */
 	u16 qidx;
-};
+
+	/* protects the ring indices and buffers */
+	struct mtx mtx __aligned(CACHE_LINE_SIZE);
+
+	/* producer side: alx_transmit() and alx_xmit() */
+	/* producer index */
+	uint16_t pidx __aligned(CACHE_LINE_SIZE);
+	/* bytes staged in br, updated atomically by alx_transmit() */
+	u_int br_bytes;
+	/* bytes ever posted to the ring; less bql_completed is in flight */
+	u_int bql_posted;
+	/* the last alx_txq_drain() stopped at the limit */
+	bool bql_stopped;
+
+	/* consumer side: alx_txintr() */
+	/* consumer index */
+	atomic_t cidx __aligned(CACHE_LINE_SIZE);
+	/*
+	 * Seconds left before the watchdog fires, 0 if idle. alx_xmit()
+	 * only arms it when the ring was idle; alx_txintr() writes it on
+	 * every completion.
+	 */
+	int watchdog_timer;
+	/* bytes ever reclaimed from the ring */
+	u_int bql_completed;
+	/* byte queue limit; alx_txq_drain() holds frames back above it */
+	u_int bql_limit;
+	/* smallest backlog seen after a completion since bql_slack_start */
+	u_int bql_slack;
+	int bql_slack_start;
+} __aligned(CACHE_LINE_SIZE);
+#define ALX_BQL_INFLIGHT(txq)	((txq)->bql_posted - (txq)->bql_completed)
+
+/* frames up to this size may be copied rather than mapped for TX */
+#define ALX_TX_COPY_SZ		128
+
+/* byte queue limits, see alx_bql_completed() */
+#define ALX_BQL_MIN		(2 * ETHER_MAX_LEN)
+#define ALX_BQL_MAX_DEF		(64 * 1024)
+
+/*
+ * Software receive steering: with a single hardware RX ring, frames are
+ * hashed onto per-CPU queues and handed to the stack from there.
+ */
+struct alx_srss {
+	struct alx_softc *sc;
+	struct taskqueue *tq;
+	struct task task;
+
+	/* protects mq */
+	struct mtx mtx;
+	struct mbufq mq;
+} __aligned(CACHE_LINE_SIZE);
+#define ALX_SRSS_MAX		16
 
 #define ALX_TX_WAKEUP_THRESH(_tq) ((_tq)->count / 4)
 #define ALX_DEFAULT_TX_WORK		128
+/* frames handled per pass before yielding to the taskqueue */
+#define ALX_DEFAULT_RX_WORK		128
 
 enum ALX_FLAGS {
 	ALX_FLAG_USING_MSIX = 0,
@@ -100,6 +225,8 @@ enum ALX_FLAGS {
 	ALX_FLAG_TASK_CHK_LINK,
 	ALX_FLAG_TASK_RESET,
 	ALX_FLAG_TASK_UPDATE_SMB,
+	ALX_FLAG_MAC_STOPPED,	/* MAC stopped cleanly, config intact */
+	ALX_FLAG_PHY_DOWN,	/* PHY powered down by alx_phy_down() */
 
 	ALX_FLAG_NUMBER_OF_FLAGS,
 };
@@ -107,9 +234,13 @@ enum ALX_FLAGS {
 struct alx_hw;
 /*
  *board specific private data structure
+ *
+ * Fields touched on every interrupt or packet (the hardware state, the
+ * lock and the queues) are kept at the end of the structure, each group
+ * starting on its own cache line. Everything before them is only used
+ * for configuration.
  */
 struct alx_softc {
-	struct alx_hw		hw;
 
 	u16		bd_number;
 
@@ -159,40 +290,83 @@ struct alx_softc {
         struct ifnet		*alx_ifp;
 	int			 alx_if_flags;
 
+	/* run ring processing in the interrupt thread */
+	int			 alx_intr_ithread;
+	/* CPU the interrupt and alx_tq are bound to, or NOCPU */
+	int			 alx_intr_cpu;
+	int			 alx_process_limit;
+	/* leave the PHY and link up while the interface is down */
+	int			 alx_keep_link;
+	/* upper bound for the TX byte queue limits, 0 to disable them */
+	int			 alx_bql_max;
+	/* largest frame sent through the TX copy buffers, 0 for none */
+	int			 alx_tx_copy_thresh;
+	/* TX priority ring for each 802.1p priority, see alx_tx_classify() */
+	uint8_t			 alx_prio_map[8];
+
+	/* software receive steering queues, or NULL if disabled */
+	struct alx_srss		*alx_srss;
+	int			 alx_nsrss;
+	uint32_t		 alx_srss_key;
+
 	struct taskqueue	*alx_tq;
 	struct task		 alx_int_task;
+	/* link handling runs on its own thread, away from the data path */
+	struct taskqueue	*alx_link_tq;
         struct task              alx_link_task;
+	/* recovery from fatal errors and TX timeouts, on alx_link_tq */
+	struct task		 alx_reset_task;
+	struct callout		 alx_tick_ch;
 
 	bus_dma_tag_t		 alx_parent_tag;
-
-	bus_dma_tag_t		 alx_tx_tag;
-	bus_dmamap_t		 alx_tx_dmamap;
-
         bus_dma_tag_t            alx_tx_buf_tag;
+	bus_dma_tag_t		 alx_tx_copy_tag;
 	bus_dma_tag_t		 alx_rx_buf_tag;
 
-	bus_dma_tag_t		 alx_rx_tag;
-	bus_dmamap_t		 alx_rx_dmamap;
+	/* Hot fields below. */
+	struct mtx		 alx_mtx __aligned(CACHE_LINE_SIZE);
 
-	bus_dma_tag_t		 alx_rr_tag;
-	bus_dmamap_t		 alx_rr_dmamap;
+	struct alx_hw		hw __aligned(CACHE_LINE_SIZE);
 
-	struct alx_tx_queue	 alx_tx_queue;
+	struct alx_tx_queue	 alx_txq[ALX_MAX_TX_QUEUES];
 	struct alx_rx_queue	 alx_rx_queue;
-
-	struct mtx		 alx_mtx;
 };
 
+/*
+ * Locking: alx_mtx is the control lock and covers init, stop, link state,
+ * ioctls and sysctls. The RX queue and each TX queue have their own lock
+ * for the data path, so transmit and receive don't serialize against each
+ * other or against configuration requests. When more than one is needed
+ * they are taken in the order control -> RX -> TX (lowest queue first).
+ * Clearing IFF_DRV_RUNNING under the control lock and then acquiring the
+ * queue locks is enough to quiesce the data path. The MDIO lock in struct
+ * alx_hw is a leaf and may be taken with or without the others held.
+ */
 #define	ALX_LOCK(sc)		mtx_lock(&(sc)->alx_mtx)
 #define	ALX_UNLOCK(sc)		mtx_unlock(&(sc)->alx_mtx)
 #define	ALX_LOCK_ASSERT(sc)	mtx_assert(&(sc)->alx_mtx, MA_OWNED)
 
+#define	ALX_RX_LOCK(rxq)	mtx_lock(&(rxq)->mtx)
+#define	ALX_RX_UNLOCK(rxq)	mtx_unlock(&(rxq)->mtx)
+#define	ALX_RX_LOCK_ASSERT(rxq)	mtx_assert(&(rxq)->mtx, MA_OWNED)
+
+#define	ALX_TX_LOCK(txq)	mtx_lock(&(txq)->mtx)
+#define	ALX_TX_TRYLOCK(txq)	mtx_trylock(&(txq)->mtx)
+#define	ALX_TX_UNLOCK(txq)	mtx_unlock(&(txq)->mtx)
+#define	ALX_TX_LOCK_ASSERT(txq)	mtx_assert(&(txq)->mtx, MA_OWNED)
+
+/*
+ * The flags are set from the interrupt filter and the queue locks as well
+ * as under the control lock, so every update must be atomic.
+ */
 #define ALX_FLAG(_adpt, _FLAG) (\
-	test_bit(ALX_FLAG_##_FLAG, &(_adpt)->flags))
+	(atomic_load_long(&(_adpt)->flags) & (1UL << ALX_FLAG_##_FLAG)) != 0)
 #define ALX_FLAG_SET(_adpt, _FLAG) (\
-	set_bit(ALX_FLAG_##_FLAG, &(_adpt)->flags))
+	atomic_set_long(&(_adpt)->flags, 1UL << ALX_FLAG_##_FLAG))
 #define ALX_FLAG_CLEAR(_adpt, _FLAG) (\
-	clear_bit(ALX_FLAG_##_FLAG, &(_adpt)->flags))
+	atomic_clear_long(&(_adpt)->flags, 1UL << ALX_FLAG_##_FLAG))
+#define ALX_FLAG_TESTANDCLEAR(_adpt, _FLAG) (\
+	atomic_testandclear_long(&(_adpt)->flags, ALX_FLAG_##_FLAG) != 0)
 
 #define ALX_TX_INC(i, s)	(((i) + 1) % (s)->tx_ringsz)
 #define ALX_TX_DEC(i, s)	(((i) + (s)->tx_ringsz - 1) % (s)->tx_ringsz)